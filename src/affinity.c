@@ -0,0 +1,159 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+
+static int parse_int(const char *name, const char *value) {
+  char *end;
+  long parsed = strtol(value, &end, 10);
+  if (end == value || *end != '\0' || parsed < 0) {
+    fprintf(stderr, "invalid value for %s: '%s'\n", name, value);
+    exit(1);
+  }
+  return parsed;
+}
+
+static void add_cpu(struct Affinity *a, long cpu) {
+  if (cpu >= CPU_SETSIZE) {
+    fprintf(stderr, "CPU %ld out of range (max %d)\n", cpu, CPU_SETSIZE - 1);
+    exit(1);
+  }
+  if (a->n_cpus == AFFINITY_MAX_CPUS) {
+    fprintf(stderr, "too many CPUs in DM_CPUS (max %d)\n", AFFINITY_MAX_CPUS);
+    exit(1);
+  }
+  a->cpus[a->n_cpus++] = cpu;
+}
+
+// "0-3,8,10-11"
+static void parse_cpu_list(struct Affinity *a, const char *list) {
+  const char *p = list;
+  while (*p != '\0') {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0)
+      goto invalid;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first)
+        goto invalid;
+    }
+    for (long cpu = first; cpu <= last; cpu++)
+      add_cpu(a, cpu);
+    if (*end == ',')
+      end++;
+    else if (*end != '\0')
+      goto invalid;
+    p = end;
+  }
+  if (a->n_cpus > 0)
+    return;
+
+invalid:
+  fprintf(stderr, "invalid value for DM_CPUS: '%s'\n", list);
+  exit(1);
+}
+
+void affinity_from_env(struct Affinity *a, int default_workers, const char *cmdline_workers) {
+  memset(a, 0, sizeof(struct Affinity));
+
+  const char *cpus = getenv("DM_CPUS");
+  if (cpus != NULL && *cpus != '\0') {
+    parse_cpu_list(a, cpus);
+  } else {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == -1) {
+      perror("sched_getaffinity");
+      exit(1);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && a->n_cpus < AFFINITY_MAX_CPUS; cpu++) {
+      if (CPU_ISSET(cpu, &set))
+        add_cpu(a, cpu);
+    }
+  }
+
+  const char *pin = getenv("DM_PIN");
+  a->pin = pin == NULL || *pin == '\0' || parse_int("DM_PIN", pin) != 0;
+
+  const char *workers = getenv("DM_WORKERS");
+  a->n_workers = default_workers;
+  if (cmdline_workers != NULL)
+    a->n_workers = parse_int("nb-workers", cmdline_workers);
+  else if (workers != NULL && *workers != '\0')
+    a->n_workers = parse_int("DM_WORKERS", workers);
+  if (a->n_workers == 0)
+    a->n_workers = a->n_cpus;
+}
+
+int affinity_cpu_of(const struct Affinity *a, int worker) {
+  if (!a->pin || a->n_cpus == 0)
+    return -1;
+  return a->cpus[worker % a->n_cpus];
+}
+
+int affinity_node_of(const struct Affinity *a, int worker) {
+  int cpu = affinity_cpu_of(a, worker);
+  if (cpu < 0)
+    return -1;
+
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (dir == NULL)
+    return -1;
+
+  int node = -1;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (sscanf(entry->d_name, "node%d", &node) == 1)
+      break;
+  }
+  closedir(dir);
+  return node;
+}
+
+// Its CPU when pinned, otherwise every CPU of the list, on which it floats.
+static void fill_set(const struct Affinity *a, int worker, cpu_set_t *set) {
+  CPU_ZERO(set);
+  if (a->pin) {
+    CPU_SET(a->cpus[worker % a->n_cpus], set);
+    return;
+  }
+  for (int i = 0; i < a->n_cpus; i++)
+    CPU_SET(a->cpus[i], set);
+}
+
+static void report_error(const struct Affinity *a, int worker, int err) {
+  if (a->pin)
+    fprintf(stderr, "cannot pin worker %d to CPU %d: %s\n", worker, affinity_cpu_of(a, worker), strerror(err));
+  else
+    fprintf(stderr, "cannot restrict worker %d to DM_CPUS: %s\n", worker, strerror(err));
+}
+
+void affinity_pin_self(const struct Affinity *a, int worker) {
+  if (a->n_cpus == 0)
+    return;
+  cpu_set_t set;
+  fill_set(a, worker, &set);
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (err != 0)
+    report_error(a, worker, err);
+}
+
+void affinity_set_attr(const struct Affinity *a, int worker, pthread_attr_t *attr) {
+  if (a->n_cpus == 0)
+    return;
+  cpu_set_t set;
+  fill_set(a, worker, &set);
+  int err = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+  if (err != 0)
+    report_error(a, worker, err);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+
+// Worker placement chosen at startup. Worker i runs on cpus[i % n_cpus] and
+// its buffers go to the NUMA node of that CPU.
+//
+//   DM_WORKERS : number of workers (0: one per usable CPU)
+//   DM_CPUS    : CPUs to use, e.g. "0-15,32-47" (default: the process affinity mask)
+//   DM_PIN     : 0 to let the threads float on those CPUs (default 1)
+//
+// A worker count given on the command line takes precedence over DM_WORKERS.
+
+#define AFFINITY_MAX_CPUS 1024
+
+struct Affinity {
+  int n_workers;
+  int n_cpus;
+  int cpus[AFFINITY_MAX_CPUS];
+  bool pin;
+};
+
+void affinity_from_env(struct Affinity *a, int default_workers, const char *cmdline_workers);
+
+// -1 when not pinned or when the node cannot be determined.
+int affinity_cpu_of(const struct Affinity *a, int worker);
+int affinity_node_of(const struct Affinity *a, int worker);
+
+// Pin the calling thread, or set the affinity of a thread about to be created.
+// With DM_PIN=0, the thread may run on any CPU of the list instead.
+void affinity_pin_self(const struct Affinity *a, int worker);
+void affinity_set_attr(const struct Affinity *a, int worker, pthread_attr_t *attr);
@@ -0,0 +1,344 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "tasks.h"
+
+// Runs every variant over a matrix of step counts, resolutions, thread counts
+// and save modes, and reports the median, median absolute deviation and
+// minimum of the wall time of each configuration, with the speedup of the
+// median over dm-base for the same steps, resolution and save mode.
+//
+// Each run is a separate process started in a scratch directory, its output
+// thrown away; the time measured includes process start-up. Variants that do
+// not take a thread count (base, v1) are run once per configuration.
+
+#define MAX_VALUES 16
+#define MAX_REPS 1000
+
+struct Variant {
+  const char *name;
+  const char *threads_env;   // NULL: number of threads as 5th argument
+  bool threaded;
+};
+
+static const struct Variant variants[] = {
+  { "base", NULL, false },
+  { "v1", NULL, false },
+  { "v2", NULL, true },
+  { "v3", NULL, true },
+  { "pipeline", "DM_THREADS", true },
+};
+#define N_VARIANTS (int)(sizeof(variants) / sizeof(variants[0]))
+
+struct Config {
+  const char *bin_dir;
+  bool enabled[N_VARIANTS];
+  int steps[MAX_VALUES], n_steps;
+  int width[MAX_VALUES], height[MAX_VALUES], n_sizes;
+  int threads[MAX_VALUES], n_threads;
+  int save[MAX_VALUES], n_save;
+  int warmup;
+  int reps;
+  bool json;
+};
+
+struct Result {
+  int variant;
+  int steps;
+  int width;
+  int height;
+  int threads;   // 0: not applicable
+  int save;
+  double median_ms;
+  double mad_ms;
+  double min_ms;
+};
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-d bin-dir] [-v base,v1,v2,v3,pipeline] [-s steps,...] [-r WxH,...]\n"
+          "          [-t threads,...] [-m save-img,...] [-w warmup] [-n reps] [-f csv|json] [-o file]\n",
+          prog);
+  exit(1);
+}
+
+static int parse_list(const char *arg, int values[MAX_VALUES]) {
+  int n = 0;
+  char *copy = strdup(arg);
+  for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (n == MAX_VALUES) {
+      fprintf(stderr, "too many values in '%s' (max %d)\n", arg, MAX_VALUES);
+      exit(1);
+    }
+    char *end;
+    long v = strtol(tok, &end, 10);
+    if (end == tok || *end != '\0' || v < 0) {
+      fprintf(stderr, "invalid value '%s'\n", tok);
+      exit(1);
+    }
+    values[n++] = v;
+  }
+  free(copy);
+  return n;
+}
+
+static int parse_sizes(const char *arg, int width[MAX_VALUES], int height[MAX_VALUES]) {
+  int n = 0;
+  char *copy = strdup(arg);
+  for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (n == MAX_VALUES || sscanf(tok, "%dx%d", &width[n], &height[n]) != 2 || width[n] <= 0 || height[n] <= 0) {
+      fprintf(stderr, "invalid resolution '%s'\n", tok);
+      exit(1);
+    }
+    n++;
+  }
+  free(copy);
+  return n;
+}
+
+static void parse_variants(const char *arg, bool enabled[N_VARIANTS]) {
+  memset(enabled, 0, N_VARIANTS * sizeof(bool));
+  char *copy = strdup(arg);
+  for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    int v = 0;
+    while (v < N_VARIANTS && strcmp(variants[v].name, tok) != 0)
+      v++;
+    if (v == N_VARIANTS) {
+      fprintf(stderr, "unknown variant '%s'\n", tok);
+      exit(1);
+    }
+    enabled[v] = true;
+  }
+  free(copy);
+}
+
+// Meson names the executables after the variant, the README after the source.
+static void executable_path(const struct Config *cfg, int variant, char *path, size_t size) {
+  snprintf(path, size, "%s/%s", cfg->bin_dir, variants[variant].name);
+  if (access(path, X_OK) == 0)
+    return;
+  snprintf(path, size, "%s/dm-%s", cfg->bin_dir, variants[variant].name);
+  if (access(path, X_OK) == 0)
+    return;
+  fprintf(stderr, "cannot find executable %s/%s or %s\n", cfg->bin_dir, variants[variant].name, path);
+  exit(1);
+}
+
+static int64_t run_once(const char *exe, const char *workdir, int variant, int steps, int width, int height,
+                        int threads, int save) {
+  char args[5][16];
+  snprintf(args[0], sizeof(args[0]), "%d", steps);
+  snprintf(args[1], sizeof(args[1]), "%d", width);
+  snprintf(args[2], sizeof(args[2]), "%d", height);
+  snprintf(args[3], sizeof(args[3]), "%d", save);
+  snprintf(args[4], sizeof(args[4]), "%d", threads);
+  bool thread_arg = variants[variant].threaded && variants[variant].threads_env == NULL;
+  char *argv[] = { (char *)exe, args[0], args[1], args[2], args[3], thread_arg ? args[4] : NULL, NULL };
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pid_t pid = fork();
+  if (pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+  if (pid == 0) {
+    if (chdir(workdir) == -1) {
+      perror("chdir");
+      _exit(127);
+    }
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0)
+      dup2(null, STDOUT_FILENO);
+    if (variants[variant].threaded && variants[variant].threads_env != NULL)
+      setenv(variants[variant].threads_env, args[4], 1);
+    execv(exe, argv);
+    perror("execv");
+    _exit(127);
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) == -1) {
+    if (errno != EINTR) {
+      perror("waitpid");
+      exit(1);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "%s %s %s %s %s failed\n", exe, args[0], args[1], args[2], args[3]);
+    exit(1);
+  }
+  return ns_diff(&t0, &t1);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static double median(double *values, int n) {
+  qsort(values, n, sizeof(double), compare_double);
+  return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+}
+
+static void measure(const struct Config *cfg, const char *workdir, struct Result *r) {
+  char exe[4096];
+  executable_path(cfg, r->variant, exe, sizeof(exe));
+  fprintf(stderr, "%s steps=%d %dx%d threads=%d save=%d\n", variants[r->variant].name, r->steps, r->width,
+          r->height, r->threads, r->save);
+
+  for (int i = 0; i < cfg->warmup; i++)
+    run_once(exe, workdir, r->variant, r->steps, r->width, r->height, r->threads, r->save);
+
+  double ms[MAX_REPS], dev[MAX_REPS];
+  for (int i = 0; i < cfg->reps; i++)
+    ms[i] = run_once(exe, workdir, r->variant, r->steps, r->width, r->height, r->threads, r->save) / 1e6;
+
+  r->median_ms = median(ms, cfg->reps);
+  r->min_ms = ms[0];
+  for (int i = 0; i < cfg->reps; i++)
+    dev[i] = ms[i] > r->median_ms ? ms[i] - r->median_ms : r->median_ms - ms[i];
+  r->mad_ms = median(dev, cfg->reps);
+}
+
+// Median of dm-base for the same steps, resolution and save mode, or 0.
+static double base_median(const struct Result *results, int n, const struct Result *r) {
+  for (int i = 0; i < n; i++) {
+    const struct Result *b = &results[i];
+    if (b->variant == 0 && b->steps == r->steps && b->width == r->width && b->height == r->height
+        && b->save == r->save)
+      return b->median_ms;
+  }
+  return 0;
+}
+
+static void print_results(FILE *fp, const struct Config *cfg, const struct Result *results, int n) {
+  if (cfg->json)
+    fprintf(fp, "[\n");
+  else
+    fprintf(fp, "variant,steps,width,height,threads,save_img,reps,median_ms,mad_ms,min_ms,speedup\n");
+
+  for (int i = 0; i < n; i++) {
+    const struct Result *r = &results[i];
+    double base = base_median(results, n, r);
+    char threads[16] = "", speedup[32] = "";
+    if (r->threads > 0)
+      snprintf(threads, sizeof(threads), "%d", r->threads);
+    if (base > 0)
+      snprintf(speedup, sizeof(speedup), "%.3f", base / r->median_ms);
+
+    if (cfg->json)
+      fprintf(fp, "  {\"variant\":\"%s\",\"steps\":%d,\"width\":%d,\"height\":%d,\"threads\":%s,\"save_img\":%d,"
+              "\"reps\":%d,\"median_ms\":%.3f,\"mad_ms\":%.3f,\"min_ms\":%.3f,\"speedup\":%s}%s\n",
+              variants[r->variant].name, r->steps, r->width, r->height, r->threads > 0 ? threads : "null",
+              r->save, cfg->reps, r->median_ms, r->mad_ms, r->min_ms, base > 0 ? speedup : "null",
+              i + 1 < n ? "," : "");
+    else
+      fprintf(fp, "%s,%d,%d,%d,%s,%d,%d,%.3f,%.3f,%.3f,%s\n", variants[r->variant].name, r->steps, r->width,
+              r->height, threads, r->save, cfg->reps, r->median_ms, r->mad_ms, r->min_ms, speedup);
+  }
+
+  if (cfg->json)
+    fprintf(fp, "]\n");
+}
+
+int main(int argc, char *argv[]) {
+  struct Config cfg = {
+    .bin_dir = ".",
+    .steps = { 50 }, .n_steps = 1,
+    .width = { 300 }, .height = { 200 }, .n_sizes = 1,
+    .threads = { 4 }, .n_threads = 1,
+    .save = { 0 }, .n_save = 1,
+    .warmup = 1,
+    .reps = 5,
+  };
+  for (int v = 0; v < N_VARIANTS; v++)
+    cfg.enabled[v] = true;
+  const char *output = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:v:s:r:t:m:w:n:f:o:")) != -1) {
+    switch (opt) {
+      case 'd': cfg.bin_dir = optarg; break;
+      case 'v': parse_variants(optarg, cfg.enabled); break;
+      case 's': cfg.n_steps = parse_list(optarg, cfg.steps); break;
+      case 'r': cfg.n_sizes = parse_sizes(optarg, cfg.width, cfg.height); break;
+      case 't': cfg.n_threads = parse_list(optarg, cfg.threads); break;
+      case 'm': cfg.n_save = parse_list(optarg, cfg.save); break;
+      case 'w': cfg.warmup = atoi(optarg); break;
+      case 'n': cfg.reps = atoi(optarg); break;
+      case 'f':
+        if (strcmp(optarg, "csv") != 0 && strcmp(optarg, "json") != 0)
+          usage(argv[0]);
+        cfg.json = strcmp(optarg, "json") == 0;
+        break;
+      case 'o': output = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || cfg.n_steps == 0 || cfg.n_sizes == 0 || cfg.n_threads == 0 || cfg.n_save == 0
+      || cfg.reps < 1 || cfg.reps > MAX_REPS || cfg.warmup < 0)
+    usage(argv[0]);
+
+  // Relative to the scratch directory the runs start in.
+  char bin_dir[4096];
+  if (realpath(cfg.bin_dir, bin_dir) == NULL) {
+    fprintf(stderr, "cannot resolve '%s': %s\n", cfg.bin_dir, strerror(errno));
+    exit(1);
+  }
+  cfg.bin_dir = bin_dir;
+
+  char workdir[] = "/tmp/bench-dm-XXXXXX";
+  if (mkdtemp(workdir) == NULL) {
+    perror("mkdtemp");
+    exit(1);
+  }
+
+  int max_results = N_VARIANTS * cfg.n_steps * cfg.n_sizes * cfg.n_threads * cfg.n_save;
+  struct Result *results = malloc(max_results * sizeof(struct Result));
+  int n = 0;
+  for (int s = 0; s < cfg.n_steps; s++)
+    for (int z = 0; z < cfg.n_sizes; z++)
+      for (int m = 0; m < cfg.n_save; m++)
+        for (int v = 0; v < N_VARIANTS; v++) {
+          if (!cfg.enabled[v])
+            continue;
+          for (int t = 0; t < (variants[v].threaded ? cfg.n_threads : 1); t++) {
+            struct Result *r = &results[n++];
+            r->variant = v;
+            r->steps = cfg.steps[s];
+            r->width = cfg.width[z];
+            r->height = cfg.height[z];
+            r->threads = variants[v].threaded ? cfg.threads[t] : 0;
+            r->save = cfg.save[m];
+            measure(&cfg, workdir, r);
+          }
+        }
+
+  FILE *fp = stdout;
+  if (output != NULL && (fp = fopen(output, "w")) == NULL) {
+    perror("cannot open output file");
+    exit(1);
+  }
+  print_results(fp, &cfg, results, n);
+  if (fp != stdout)
+    fclose(fp);
+
+  // Remove what the runs wrote
+  char cmd[4200];
+  snprintf(cmd, sizeof(cmd), "rm -rf '%s'", workdir);
+  if (system(cmd) != 0)
+    fprintf(stderr, "cannot remove %s\n", workdir);
+  free(results);
+  return 0;
+}
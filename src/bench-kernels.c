@@ -0,0 +1,375 @@
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "tasks.h"
+
+// Drives each kernel on its own over synthetic inputs and prints its
+// throughput as CSV: MPix/s for the image kernels, pair interactions/s for
+// the simulation, and GB/s for both. The bytes counted are those each call
+// must at least read and write (3 bytes per pixel and per image, sizeof(struct
+// Body) per body), not the traffic the cache hierarchy actually sees.
+//
+// Image kernels run on sparse frames (the solar system scene, almost all
+// black), dense frames (every pixel lit, smooth gradient) and random frames
+// (uniform random bytes). For the generation, the frame kind selects the
+// bodies drawn: the scene, 9 bodies large enough to cover the frame, or 9
+// bodies at random positions with random radii. Each working set is labelled
+// "cache" when it fits in the last level cache, "dram" otherwise.
+//
+// Every measurement doubles the number of calls until a batch lasts at least
+// min_ms, then times `reps` batches of that size and keeps the median and
+// the minimum time per call.
+
+#define MAX_VALUES 16
+
+enum Kernel {
+  K_SIMULATE
+, K_GENERATE
+, K_BLUR
+, K_GRAYSCALE
+, K_STATS
+, K_MAX
+};
+
+static const char *kernel_names[K_MAX] = {
+  [K_SIMULATE] = "simulate",
+  [K_GENERATE] = "generate",
+  [K_BLUR] = "blur",
+  [K_GRAYSCALE] = "grayscale",
+  [K_STATS] = "stats",
+};
+
+enum Frame {
+  F_SPARSE
+, F_DENSE
+, F_RANDOM
+, F_MAX
+};
+
+static const char *frame_names[F_MAX] = {
+  [F_SPARSE] = "sparse",
+  [F_DENSE] = "dense",
+  [F_RANDOM] = "random",
+};
+
+struct Config {
+  bool kernels[K_MAX];
+  bool frames[F_MAX];
+  int width[MAX_VALUES], height[MAX_VALUES], n_sizes;
+  int bodies[MAX_VALUES], n_bodies;
+  int min_ms;
+  int reps;
+  size_t llc_size;
+};
+
+// What one call of a kernel works on.
+struct Input {
+  enum Kernel kernel;
+  struct Body *bodies;
+  int n;
+  struct Image *in;
+  struct Image *out;
+};
+
+struct Result {
+  long calls;               // per batch
+  double median_ns;         // per call
+  double min_ns;
+};
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [-k simulate,generate,blur,grayscale,stats] [-f sparse,dense,random]\n"
+          "          [-r WxH,...] [-n bodies,...] [-t min-ms] [-R reps] [-c llc-kib]\n",
+          prog);
+  exit(1);
+}
+
+static void parse_names(const char *arg, const char *names[], int count, bool enabled[]) {
+  memset(enabled, 0, count * sizeof(bool));
+  char *copy = strdup(arg);
+  for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    int i = 0;
+    while (i < count && strcmp(names[i], tok) != 0)
+      i++;
+    if (i == count) {
+      fprintf(stderr, "unknown name '%s'\n", tok);
+      exit(1);
+    }
+    enabled[i] = true;
+  }
+  free(copy);
+}
+
+static int parse_list(const char *arg, int values[MAX_VALUES]) {
+  int n = 0;
+  char *copy = strdup(arg);
+  for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    char *end;
+    long v = strtol(tok, &end, 10);
+    if (n == MAX_VALUES || end == tok || *end != '\0' || v < 2) {
+      fprintf(stderr, "invalid value '%s'\n", tok);
+      exit(1);
+    }
+    values[n++] = v;
+  }
+  free(copy);
+  return n;
+}
+
+static int parse_sizes(const char *arg, int width[MAX_VALUES], int height[MAX_VALUES]) {
+  int n = 0;
+  char *copy = strdup(arg);
+  for (char *tok = strtok(copy, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    if (n == MAX_VALUES || sscanf(tok, "%dx%d", &width[n], &height[n]) != 2 || width[n] <= 0 || height[n] <= 0) {
+      fprintf(stderr, "invalid resolution '%s'\n", tok);
+      exit(1);
+    }
+    n++;
+  }
+  free(copy);
+  return n;
+}
+
+// Falls back to 8 MiB when the C library does not know; -c overrides it, for
+// virtual machines that report the cache of the whole host.
+static size_t llc_size(void) {
+  long size = -1;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+  size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+  if (size <= 0)
+    size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+  return size > 0 ? (size_t)size : (size_t)8 << 20;
+}
+
+static double random_unit(void) {
+  return (double)rand() / RAND_MAX;
+}
+
+// n bodies on circular-ish orbits between 0.3 and 30 AU around the scene's
+// sun, with small masses: the orbits stay bounded while batches run.
+static struct Body * make_bodies(int n) {
+  struct Body *bodies = malloc(n * sizeof(struct Body));
+  if (bodies == NULL) {
+    perror("cannot allocate bodies");
+    exit(1);
+  }
+  struct Body scene[N_BODIES];
+  init_bodies(scene, 1);
+  for (int i = 0; i < n; i++) {
+    if (i < N_BODIES) {
+      bodies[i] = scene[i];
+      continue;
+    }
+    double dist = 0.3 + 29.7 * random_unit();
+    double angle = 2 * M_PI * random_unit();
+    double speed = sqrt(G / dist);
+    bodies[i] = scene[1 + i % (N_BODIES - 1)];
+    bodies[i].x = dist * cos(angle);
+    bodies[i].y = dist * sin(angle);
+    bodies[i].vx = -speed * sin(angle);
+    bodies[i].vy = speed * cos(angle);
+    bodies[i].mass = 1e-9 * (1 + random_unit());
+  }
+  return bodies;
+}
+
+static void frame_bodies(enum Frame frame, struct Body bodies[N_BODIES]) {
+  init_bodies(bodies, 1);
+  for (int i = 0; i < N_BODIES && frame != F_SPARSE; i++) {
+    if (frame == F_DENSE) {
+      // Radius of 30 to 70 units of the 140 x 60 frame, over its middle
+      bodies[i].x = 10 - 60 + 140 * (i + 0.5) / N_BODIES;
+      bodies[i].y = 0;
+      bodies[i].radius_scale = (30 + 40 * (i % 2)) / bodies[i].radius;
+    } else {
+      bodies[i].x = -60 + 140 * random_unit();
+      bodies[i].y = -30 + 60 * random_unit();
+      bodies[i].radius_scale = 20 * random_unit() / bodies[i].radius;
+    }
+  }
+}
+
+static struct Image * make_image(int width, int height) {
+  struct Image *img = alloc_img(width, height);
+  if (img == NULL) {
+    perror("cannot allocate image");
+    exit(1);
+  }
+  return img;
+}
+
+static void fill_frame(enum Frame frame, struct Image *img) {
+  size_t n = 3 * (size_t)img->width * img->height;
+  if (frame == F_SPARSE) {
+    struct Body bodies[N_BODIES];
+    init_bodies(bodies, 1);
+    generate_image_rows(bodies, N_BODIES, img, 0, img->height);
+  } else if (frame == F_DENSE) {
+    for (int y = 0; y < img->height; y++)
+      for (int x = 0; x < img->width; x++) {
+        uint8_t *p = img->data + 3 * ((size_t)y * img->width + x);
+        p[0] = 1 + 254 * x / img->width;
+        p[1] = 1 + 254 * y / img->height;
+        p[2] = 128;
+      }
+  } else {
+    for (size_t i = 0; i < n; i++)
+      img->data[i] = rand();
+  }
+}
+
+static void run_calls(const struct Input *input, long calls) {
+  struct ImageStats stats;
+  for (long i = 0; i < calls; i++) {
+    switch (input->kernel) {
+      case K_SIMULATE: simulate_n_bodies(input->bodies, input->n, 1.0); break;
+      case K_GENERATE: generate_image_from_bodies(input->bodies, input->n, input->in); break;
+      case K_BLUR: apply_gaussian_blur(input->in, input->out); break;
+      case K_GRAYSCALE: convert_to_grayscale(input->in, input->out); break;
+      case K_STATS: compute_image_statistics(input->in, &stats); break;
+      default: break;
+    }
+  }
+}
+
+static int64_t time_calls(const struct Input *input, long calls) {
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  run_calls(input, calls);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return ns_diff(&t0, &t1);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static struct Result measure(const struct Config *cfg, const struct Input *input) {
+  struct Result r;
+  r.calls = 1;
+  // The first call also warms up the caches
+  while (time_calls(input, r.calls) < cfg->min_ms * 1000000LL)
+    r.calls *= 2;
+
+  double ns[cfg->reps];
+  for (int i = 0; i < cfg->reps; i++)
+    ns[i] = (double)time_calls(input, r.calls) / r.calls;
+  qsort(ns, cfg->reps, sizeof(double), compare_double);
+  r.median_ns = cfg->reps % 2 ? ns[cfg->reps / 2] : (ns[cfg->reps / 2 - 1] + ns[cfg->reps / 2]) / 2;
+  r.min_ns = ns[0];
+  return r;
+}
+
+// `pixels` or `pairs` is 0 when the rate does not apply.
+static void print_result(const struct Config *cfg, enum Kernel kernel, const char *frame, int width, int height,
+                         int n, size_t bytes, size_t working_set, double pixels, double pairs,
+                         const struct Result *r) {
+  double s = r->median_ns / 1e9;
+  char size[32] = "", bodies[16] = "", mpix[32] = "", rate[32] = "";
+  if (width > 0)
+    snprintf(size, sizeof(size), "%d,%d", width, height);
+  else
+    snprintf(size, sizeof(size), ",");
+  if (n > 0)
+    snprintf(bodies, sizeof(bodies), "%d", n);
+  if (pixels > 0)
+    snprintf(mpix, sizeof(mpix), "%.1f", pixels / s / 1e6);
+  if (pairs > 0)
+    snprintf(rate, sizeof(rate), "%.4g", pairs / s);
+  printf("%s,%s,%s,%s,%zu,%s,%ld,%.1f,%.1f,%s,%.2f,%s\n", kernel_names[kernel], frame, size, bodies,
+         working_set >> 10, working_set <= cfg->llc_size ? "cache" : "dram", r->calls, r->median_ns, r->min_ns,
+         mpix, bytes / s / 1e9, rate);
+  fflush(stdout);
+}
+
+static void bench_simulate(const struct Config *cfg) {
+  for (int b = 0; b < cfg->n_bodies; b++) {
+    int n = cfg->bodies[b];
+    struct Input input = { .kernel = K_SIMULATE, .bodies = make_bodies(n), .n = n };
+    struct Result r = measure(cfg, &input);
+    size_t bytes = 2 * n * sizeof(struct Body);
+    print_result(cfg, K_SIMULATE, "", 0, 0, n, bytes, n * sizeof(struct Body), 0, (double)n * (n - 1), &r);
+    free(input.bodies);
+  }
+}
+
+static void bench_images(const struct Config *cfg, enum Kernel kernel) {
+  for (int z = 0; z < cfg->n_sizes; z++) {
+    int width = cfg->width[z], height = cfg->height[z];
+    size_t frame_bytes = 3 * (size_t)width * height;
+    struct Image *in = make_image(width, height);
+    struct Image *out = make_image(width, height);
+
+    for (int f = 0; f < F_MAX; f++) {
+      if (!cfg->frames[f])
+        continue;
+      struct Body bodies[N_BODIES];
+      struct Input input = { .kernel = kernel, .in = in, .out = out };
+      size_t bytes = frame_bytes, working_set = frame_bytes;
+      if (kernel == K_GENERATE) {
+        frame_bodies(f, bodies);
+        input.bodies = bodies;
+        input.n = N_BODIES;
+      } else {
+        fill_frame(f, in);
+        if (kernel != K_STATS)
+          bytes = working_set = 2 * frame_bytes;
+      }
+      struct Result r = measure(cfg, &input);
+      print_result(cfg, kernel, frame_names[f], width, height, 0, bytes, working_set, (double)width * height, 0, &r);
+    }
+
+    free_img(in);
+    free_img(out);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct Config cfg = {
+    .width = { 64, 256, 1024, 4096 }, .height = { 64, 256, 1024, 4096 }, .n_sizes = 4,
+    .bodies = { 9, 100, 1000, 10000, 100000 }, .n_bodies = 5,
+    .min_ms = 200,
+    .reps = 5,
+    .llc_size = llc_size(),
+  };
+  for (int k = 0; k < K_MAX; k++)
+    cfg.kernels[k] = true;
+  for (int f = 0; f < F_MAX; f++)
+    cfg.frames[f] = true;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "k:f:r:n:t:R:c:")) != -1) {
+    switch (opt) {
+      case 'k': parse_names(optarg, kernel_names, K_MAX, cfg.kernels); break;
+      case 'f': parse_names(optarg, frame_names, F_MAX, cfg.frames); break;
+      case 'r': cfg.n_sizes = parse_sizes(optarg, cfg.width, cfg.height); break;
+      case 'n': cfg.n_bodies = parse_list(optarg, cfg.bodies); break;
+      case 't': cfg.min_ms = atoi(optarg); break;
+      case 'R': cfg.reps = atoi(optarg); break;
+      case 'c': cfg.llc_size = (size_t)atol(optarg) << 10; break;
+      default: usage(argv[0]);
+    }
+  }
+  if (optind != argc || cfg.min_ms < 0 || cfg.reps < 1)
+    usage(argv[0]);
+  srand(1);
+
+  fprintf(stderr, "last level cache: %zu KiB\n", cfg.llc_size >> 10);
+  printf("kernel,frame,width,height,bodies,working_set_kib,resident,calls,ns_per_call,min_ns_per_call,"
+         "mpix_per_s,gb_per_s,pairs_per_s\n");
+  if (cfg.kernels[K_SIMULATE])
+    bench_simulate(&cfg);
+  for (int k = K_GENERATE; k < K_MAX; k++)
+    if (cfg.kernels[k])
+      bench_images(&cfg, k);
+  return 0;
+}
@@ -0,0 +1,178 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "task-queue.h"
+#include "tasks.h"
+
+// Compares the task queue of dm-v2 against the mutex + condition variables
+// ring it replaced, with the access pattern of the worker pool: every worker
+// pops a task and pushes its successor. A few tokens circulate until `ops`
+// pops have been done, then each worker receives an exit token.
+
+#define BUFFER_SIZE 128
+
+typedef struct {
+  int type;
+  int step;
+} token_t;
+
+#define TOKEN_EXIT -1
+
+// The previous dm-v2 buffer, kept as the reference.
+struct LockedBuffer {
+  token_t tasks[BUFFER_SIZE];
+  int in;
+  int out;
+  int count;
+  pthread_mutex_t mutex;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+};
+
+static void locked_init(struct LockedBuffer *buf) {
+  buf->in = buf->out = buf->count = 0;
+  pthread_mutex_init(&buf->mutex, NULL);
+  pthread_cond_init(&buf->not_empty, NULL);
+  pthread_cond_init(&buf->not_full, NULL);
+}
+
+static void locked_pop(struct LockedBuffer *buf, token_t *task) {
+  pthread_mutex_lock(&buf->mutex);
+  while (buf->count == 0)
+    pthread_cond_wait(&buf->not_empty, &buf->mutex);
+  *task = buf->tasks[buf->out];
+  buf->out = (buf->out + 1) % BUFFER_SIZE;
+  buf->count--;
+  pthread_cond_signal(&buf->not_full);
+  pthread_mutex_unlock(&buf->mutex);
+}
+
+static void locked_push(struct LockedBuffer *buf, token_t task) {
+  pthread_mutex_lock(&buf->mutex);
+  while (buf->count == BUFFER_SIZE)
+    pthread_cond_wait(&buf->not_full, &buf->mutex);
+  buf->tasks[buf->in] = task;
+  buf->in = (buf->in + 1) % BUFFER_SIZE;
+  buf->count++;
+  pthread_cond_signal(&buf->not_empty);
+  pthread_mutex_unlock(&buf->mutex);
+}
+
+enum QueueKind {
+  QUEUE_LOCKED
+, QUEUE_LOCKFREE
+};
+
+struct Bench {
+  enum QueueKind kind;
+  struct LockedBuffer locked;
+  struct TaskQueue lockfree;
+  int workers;
+  int tokens;
+  long ops;
+  int work;
+  atomic_long tickets;
+};
+
+static void bench_push(struct Bench *b, token_t t) {
+  if (b->kind == QUEUE_LOCKED)
+    locked_push(&b->locked, t);
+  else
+    task_queue_push(&b->lockfree, &t);
+}
+
+static void bench_pop(struct Bench *b, token_t *t) {
+  if (b->kind == QUEUE_LOCKED)
+    locked_pop(&b->locked, t);
+  else
+    task_queue_pop(&b->lockfree, t);
+}
+
+static void * worker(void *arg) {
+  struct Bench *b = arg;
+  volatile int sink = 0;
+  for (;;) {
+    token_t t;
+    bench_pop(b, &t);
+    if (t.type == TOKEN_EXIT)
+      break;
+
+    for (int i = 0; i < b->work; i++)
+      sink += i;
+
+    long ticket = atomic_fetch_add(&b->tickets, 1);
+    if (ticket < b->ops) {
+      t.step++;
+      bench_push(b, t);
+    } else if (ticket == b->ops + b->tokens - 1) {
+      token_t exit_token = { TOKEN_EXIT, 0 };
+      for (int i = 0; i < b->workers; i++)
+        bench_push(b, exit_token);
+    }
+  }
+  return NULL;
+}
+
+static int64_t run(enum QueueKind kind, int workers, long ops, int work) {
+  struct Bench b;
+  b.kind = kind;
+  b.workers = workers;
+  b.tokens = 2 * workers < BUFFER_SIZE / 2 ? 2 * workers : BUFFER_SIZE / 2;
+  b.ops = ops;
+  b.work = work;
+  atomic_init(&b.tickets, 0);
+  if (kind == QUEUE_LOCKED)
+    locked_init(&b.locked);
+  else
+    task_queue_init(&b.lockfree, BUFFER_SIZE, sizeof(token_t));
+
+  for (int i = 0; i < b.tokens; i++) {
+    token_t t = { 0, 0 };
+    bench_push(&b, t);
+  }
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  pthread_t threads[workers];
+  for (int i = 0; i < workers; i++) {
+    if (pthread_create(&threads[i], NULL, worker, &b) != 0) {
+      fprintf(stderr, "cannot create thread %d\n", i);
+      exit(1);
+    }
+  }
+  for (int i = 0; i < workers; i++)
+    pthread_join(threads[i], NULL);
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+
+  if (kind == QUEUE_LOCKFREE)
+    task_queue_destroy(&b.lockfree);
+  return ns_diff(&t0, &t1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 3) {
+    fprintf(stderr, "usage: %s [ops] [work-iterations]\n", argv[0]);
+    exit(1);
+  }
+  long ops = argc > 1 ? atol(argv[1]) : 1000000;
+  int work = argc > 2 ? atoi(argv[2]) : 0;
+
+  const int worker_counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+  const char *names[] = { "mutex", "lockfree" };
+
+  printf("queue,workers,ops,elapsed_ms,ns_per_op,mops_per_s\n");
+  for (size_t w = 0; w < sizeof(worker_counts) / sizeof(worker_counts[0]); w++) {
+    for (int kind = QUEUE_LOCKED; kind <= QUEUE_LOCKFREE; kind++) {
+      int64_t ns = run(kind, worker_counts[w], ops, work);
+      printf("%s,%d,%ld,%.2f,%.1f,%.2f\n", names[kind], worker_counts[w], ops,
+             ns / 1e6, (double)ns / ops, ops * 1e3 / ns);
+      fflush(stdout);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,218 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "checkpoint.h"
+#include "metrics.h"
+
+struct CheckpointHeader {
+  char magic[4];
+  uint32_t version;
+  int32_t next_step;
+  int32_t n;
+  uint32_t seed;
+  uint32_t integrator;
+  double dt;
+};
+
+struct TrajCacheHeader {
+  char magic[4];
+  uint32_t version;
+  int32_t n;
+  uint32_t integrator;
+  double dt;
+  uint64_t scene_hash;
+};
+
+struct TrajRecord {
+  double x;
+  double y;
+  double vx;
+  double vy;
+};
+
+void checkpoint_save(const char *filename, const struct Body bodies[], int n, int next_step, unsigned int seed, double dt) {
+  char tmp_filename[256];
+  snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+
+  FILE *fp = fopen(tmp_filename, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "cannot open checkpoint '%s': %s\n", tmp_filename, strerror(errno));
+    exit(1);
+  }
+
+  struct CheckpointHeader header = {0};
+  memcpy(header.magic, CHECKPOINT_MAGIC, 4);
+  header.version = CHECKPOINT_VERSION;
+  header.next_step = next_step;
+  header.n = n;
+  header.seed = seed;
+  header.integrator = integrator_key();
+  header.dt = dt;
+
+  if (fwrite(&header, sizeof(header), 1, fp) != 1
+      || fwrite(bodies, sizeof(struct Body), n, fp) != (size_t)n
+      || fclose(fp) != 0) {
+    perror("cannot write checkpoint");
+    exit(1);
+  }
+
+  if (rename(tmp_filename, filename) == -1) {
+    perror("cannot rename checkpoint");
+    exit(1);
+  }
+}
+
+bool checkpoint_load(const char *filename, struct Body bodies[], int n, unsigned int seed, double dt, int *next_step) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "cannot open checkpoint '%s': %s\n", filename, strerror(errno));
+    return false;
+  }
+
+  struct CheckpointHeader header;
+  bool ok = fread(&header, sizeof(header), 1, fp) == 1
+    && memcmp(header.magic, CHECKPOINT_MAGIC, 4) == 0
+    && header.version == CHECKPOINT_VERSION
+    && header.n == n
+    && header.seed == seed
+    && header.integrator == integrator_key()
+    && header.dt == dt
+    && fread(bodies, sizeof(struct Body), n, fp) == (size_t)n;
+  fclose(fp);
+
+  if (!ok) {
+    fprintf(stderr, "checkpoint '%s' does not match this simulation\n", filename);
+    return false;
+  }
+  *next_step = header.next_step;
+  return true;
+}
+
+// FNV-1a over the fields of the initial scene (struct padding excluded).
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size) {
+  const uint8_t *p = data;
+  for (size_t i = 0; i < size; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static uint64_t hash_scene(const struct Body bodies[], int n) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < n; i++) {
+    const struct Body *b = &bodies[i];
+    double fields[7] = { b->x, b->y, b->vx, b->vy, b->mass, b->radius, b->radius_scale };
+    uint8_t color[3] = { b->r, b->g, b->b };
+    h = hash_bytes(h, fields, sizeof(fields));
+    h = hash_bytes(h, color, sizeof(color));
+  }
+  return h;
+}
+
+struct TrajCache * traj_cache_open(const char *dir, const struct Body initial[], int n, unsigned int seed, double dt) {
+  struct TrajCacheHeader expected = {0};
+  memcpy(expected.magic, TRAJ_CACHE_MAGIC, 4);
+  expected.version = TRAJ_CACHE_VERSION;
+  expected.n = n;
+  expected.integrator = integrator_key();
+  expected.dt = dt;
+  expected.scene_hash = hash_scene(initial, n);
+
+  char key[16] = "";
+  if (expected.integrator != 0)
+    snprintf(key, sizeof(key), "-i%08x", expected.integrator);
+  char filename[512];
+  snprintf(filename, sizeof(filename), "%s/traj-%016llx-s%u-dt%g%s.bin",
+           dir, (unsigned long long)expected.scene_hash, seed, dt, key);
+
+  int fd = open(filename, O_RDWR | O_CREAT, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "cannot open trajectory cache '%s': %s\n", filename, strerror(errno));
+    exit(1);
+  }
+
+  struct TrajCacheHeader header;
+  struct stat st;
+  const size_t record_size = n * sizeof(struct TrajRecord);
+  int cached_steps = 0;
+
+  if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(header)
+      && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+      && memcmp(&header, &expected, sizeof(header)) == 0) {
+    cached_steps = (st.st_size - sizeof(header)) / record_size;
+  } else if (ftruncate(fd, 0) == -1 || pwrite(fd, &expected, sizeof(expected), 0) != sizeof(expected)) {
+    perror("cannot write trajectory cache");
+    exit(1);
+  }
+
+  struct TrajCache *tc = malloc(sizeof(struct TrajCache));
+  if (tc == NULL) {
+    perror("cannot allocate trajectory cache");
+    exit(1);
+  }
+  tc->fd = fd;
+  tc->n = n;
+  tc->cached_steps = cached_steps;
+  return tc;
+}
+
+bool traj_cache_read(struct TrajCache *tc, int step, struct Body bodies[]) {
+  if (step >= tc->cached_steps)
+    return false;
+
+  METRICS_SCOPE(NBODIES_SIMULATION);
+
+  struct TrajRecord records[tc->n];
+  size_t size = sizeof(records);
+  off_t offset = sizeof(struct TrajCacheHeader) + (off_t)step * size;
+  if (pread(tc->fd, records, size, offset) != (ssize_t)size) {
+    perror("cannot read trajectory cache");
+    exit(1);
+  }
+
+  for (int i = 0; i < tc->n; i++) {
+    bodies[i].x = records[i].x;
+    bodies[i].y = records[i].y;
+    bodies[i].vx = records[i].vx;
+    bodies[i].vy = records[i].vy;
+  }
+
+  return true;
+}
+
+// Only extends the cache: a step is stored if every earlier step already is.
+void traj_cache_append(struct TrajCache *tc, int step, const struct Body bodies[]) {
+  if (step != tc->cached_steps)
+    return;
+
+  struct TrajRecord records[tc->n];
+  for (int i = 0; i < tc->n; i++) {
+    records[i].x = bodies[i].x;
+    records[i].y = bodies[i].y;
+    records[i].vx = bodies[i].vx;
+    records[i].vy = bodies[i].vy;
+  }
+
+  size_t size = sizeof(records);
+  off_t offset = sizeof(struct TrajCacheHeader) + (off_t)step * size;
+  if (pwrite(tc->fd, records, size, offset) != (ssize_t)size) {
+    perror("cannot write trajectory cache");
+    exit(1);
+  }
+  tc->cached_steps++;
+}
+
+void traj_cache_close(struct TrajCache *tc) {
+  close(tc->fd);
+  free(tc);
+}
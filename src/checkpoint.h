@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tasks.h"
+
+// A checkpoint holds the full state of the bodies together with the step at
+// which the simulation resumes. It is written to a temporary file and renamed
+// so that a crash during the write never leaves a truncated checkpoint.
+//
+// File layout (native byte order):
+//   "DMCK" u32 version, i32 next_step, i32 n, u32 seed, u32 integrator key,
+//   f64 dt, struct Body[n]
+#define CHECKPOINT_MAGIC "DMCK"
+#define CHECKPOINT_VERSION 1
+
+void checkpoint_save(const char *filename, const struct Body bodies[], int n, int next_step, unsigned int seed, double dt);
+bool checkpoint_load(const char *filename, struct Body bodies[], int n, unsigned int seed, double dt, int *next_step);
+
+// A trajectory cache stores, for every simulated step, the position and
+// velocity of each body after that step. It is keyed on the initial scene
+// (which covers the scenario and the seed), on dt and on the integrator
+// (integrator_key, 0 for euler), so a render-only run
+// reads the positions back instead of calling simulate_n_bodies. Steps that
+// are not cached yet are appended as they are simulated.
+//
+// File name : <dir>/traj-<scene hash>-s<seed>-dt<dt>[-i<integrator key>].bin
+// File layout (native byte order):
+//   "DMTC" u32 version, i32 n, u32 integrator key, f64 dt, u64 scene hash,
+//   then one record per step: { f64 x, f64 y, f64 vx, f64 vy }[n]
+#define TRAJ_CACHE_MAGIC "DMTC"
+#define TRAJ_CACHE_VERSION 1
+
+struct TrajCache {
+  int fd;
+  int n;
+  int cached_steps;
+};
+
+struct TrajCache * traj_cache_open(const char *dir, const struct Body initial[], int n, unsigned int seed, double dt);
+bool traj_cache_read(struct TrajCache *tc, int step, struct Body bodies[]);
+void traj_cache_append(struct TrajCache *tc, int step, const struct Body bodies[]);
+void traj_cache_close(struct TrajCache *tc);
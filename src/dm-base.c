@@ -3,7 +3,12 @@
 #include <stdlib.h>
 #include <time.h>
 
+#include "checkpoint.h"
+#include "frame-stream.h"
+#include "live-metrics.h"
+#include "stats-sink.h"
 #include "tasks.h"
+#include "trace.h"
 
 int main(int argc, char *argv[]) {
   if (argc < 1)
@@ -13,45 +18,49 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
+  trace_open_from_env();
   int nb_steps = atoi(argv[1]);
   int width = atoi(argv[2]);
   int height = atoi(argv[3]);
+  report_frame_size(width, height);
   int save_img = atoi(argv[4]);
 
-  struct Body bodies[N_BODIES] = {
-    { 0.00, 0.0,  0.000, 0.0,      1.0, 0.00465047,  5.0e2,  255, 204,   0},
-    { 0.39, 0.0,  0.323, 0.0,  1.65e-7,   1.765e-5, 10.0e3,  169, 169, 169},
-    { 0.72, 0.0,  0.218, 0.0,  2.45e-6,   4.552e-5, 10.0e3,  255, 204, 153},
-    { 1.00, 0.0,  0.170, 0.0,  3.00e-6,   4.258e-5, 10.0e3,    0, 102, 204},
-    { 1.52, 0.0,  0.128, 0.0,  3.21e-7,   2.279e-5, 10.0e3,  255, 102,   0},
-    { 5.20, 0.0,  0.060, 0.0,  9.55e-4,  4.7789e-4,  5.0e3,   204, 153, 102},
-    { 9.58, 0.0,  0.043, 0.0,  2.86e-4,  4.0072e-4,  5.0e3,   210, 180, 140},
-    {19.22, 0.0,  0.030, 0.0,  4.36e-5,  1.6938e-4,  5.0e3,   173, 216, 230},
-    {30.05, 0.0,  0.024, 0.0,  5.17e-5,  1.6418e-4,  5.0e3,     0,   0, 128},
-  };
-
-  srand(1);
-
-
-  for (int i = 1; i < N_BODIES; ++i) {
-    double dist = bodies[i].x;
-    double angle = 2 * M_PI * (double)rand() / RAND_MAX;
-    bodies[i].x = dist * cos(angle);
-    bodies[i].y = dist * sin(angle);
-
-    double rot_speed = bodies[i].vx;
-    bodies[i].vx = -rot_speed * bodies[i].y;
-    bodies[i].vy =  rot_speed * bodies[i].x;
-  }
+  struct Body bodies[N_BODIES];
+  unsigned int seed = env_int("DM_SEED", 1);
+  init_bodies(bodies, seed);
+  int substeps = substeps_from_env();
+  integrator_init_from_env();
+  const double dt = 1.0 / substeps;
+
+  // DM_TRAJ_CACHE=<dir> : reuse the positions of a previous run with the same scene, seed and dt
+  const char * traj_dir = getenv("DM_TRAJ_CACHE");
+  struct TrajCache * traj = NULL;
+  if (traj_dir != NULL)
+    traj = traj_cache_open(traj_dir, bodies, N_BODIES, seed, dt);
+
+  // DM_CHECKPOINT=<file> : snapshot every DM_CHECKPOINT_EVERY steps, DM_RESUME=<file> : restart from it
+  const char * checkpoint_filename = getenv("DM_CHECKPOINT");
+  const char * resume_filename = getenv("DM_RESUME");
+  int checkpoint_every = env_int("DM_CHECKPOINT_EVERY", 100);
+  int first_step = 0;
+  if (resume_filename != NULL && !checkpoint_load(resume_filename, bodies, N_BODIES, seed, dt, &first_step))
+    exit(1);
 
   const char * stats_filename = "./img-stats.csv";
+  const char * stats_bin_filename = "./img-stats.bin";
   const char * png_filename_format = "./img%03d.png";
-
-  // clean files
-  remove(stats_filename);
+  const char * stream_filename = "./img-frames.dmfs";
+
+  // clean files, keeping the output of the steps before a resume
+  if (first_step == 0) {
+    remove(stats_filename);
+    remove(stats_bin_filename);
+    if (save_img == 2)
+      remove(stream_filename);
+  }
   char filename[256];
-  if (save_img) {
-    for (int i = 0; i < nb_steps; ++i) {
+  if (save_img == 1) {
+    for (int i = first_step; i < nb_steps; ++i) {
       snprintf(filename, 256, png_filename_format, i);
       remove(filename);
     }
@@ -60,27 +69,57 @@ int main(int argc, char *argv[]) {
   struct Image * img1 = alloc_img(width, height);
   struct Image * img2 = alloc_img(width, height);
   struct ImageStats stats;
+  enum StatsFormat stats_format = stats_format_from_env();
+  struct StatsSink *stats_sink = stats_sink_append(stats_format == STATS_BIN ? stats_bin_filename : stats_filename, stats_format,
+                                                   env_int("DM_STATS_FLUSH_RECORDS", 256), env_int("DM_STATS_FLUSH_MS", 1000),
+                                                   first_step);
+
+  // save-img 2: keyframes + deltas in a single stream instead of one PNG per step
+  struct FrameStream * stream = NULL;
+  if (save_img == 2)
+    stream = frame_stream_append(stream_filename, width, height, env_int("DM_KEYFRAME_INTERVAL", 30), first_step);
 
   struct timespec t0, t1;
   if (clock_gettime(CLOCK_BOOTTIME, &t0) == -1) {
     perror("clock_gettime");
     exit(1);
   }
-
-  for (int current_step = 0; current_step < nb_steps; ++current_step) {
-    simulate_n_bodies(bodies, N_BODIES, 1.0);
+  struct LiveProgress progress = { -1, first_step, stats_sink };
+  live_metrics_start_from_env(nb_steps, live_sample_progress, &progress);
+
+  for (int current_step = first_step; current_step < nb_steps; ++current_step) {
+    if (traj == NULL || !traj_cache_read(traj, current_step, bodies)) {
+      simulate_substeps(bodies, N_BODIES, dt, substeps);
+      if (traj != NULL)
+        traj_cache_append(traj, current_step, bodies);
+    }
 
     generate_image_from_bodies(bodies, N_BODIES, img1);
     apply_gaussian_blur(img1, img2);
 
-    if (save_img)
+    if (save_img == 1)
       save_img_as_png(img2, png_filename_format, current_step);
+    else if (save_img == 2)
+      frame_stream_write(stream, img2, current_step);
 
     convert_to_grayscale(img2, img1);
     compute_image_statistics(img1, &stats);
-    save_stats(&stats, stats_filename, current_step);
+    stats_sink_push(stats_sink, &stats, current_step);
+
+    if (checkpoint_filename != NULL && (current_step + 1) % checkpoint_every == 0) {
+      stats_sink_flush(stats_sink);
+      checkpoint_save(checkpoint_filename, bodies, N_BODIES, current_step + 1, seed, dt);
+    }
+    atomic_store_explicit(&progress.steps_done, current_step + 1, memory_order_relaxed);
   }
 
+  live_metrics_stop();
+  if (stream != NULL)
+    frame_stream_close(stream);
+  stats_sink_close(stats_sink);
+  if (traj != NULL)
+    traj_cache_close(traj);
+
   if (clock_gettime(CLOCK_BOOTTIME, &t1) == -1) {
     perror("clock_gettime");
     exit(1);
@@ -89,6 +128,7 @@ int main(int argc, char *argv[]) {
   int64_t total_ns = ns_diff(&t0, &t1);
   printf("ok\n");
   print_elapsed_time_stats(total_ns);
+  trace_close();
 
   free_img(img1); img1 = NULL;
   free_img(img2); img2 = NULL;
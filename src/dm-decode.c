@@ -0,0 +1,25 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "frame-stream.h"
+#include "tasks.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 3 && argc != 4) {
+    fprintf(stderr, "usage: %s <frame-stream> <step> [png-format]\n", argv[0]);
+    exit(1);
+  }
+
+  const char * stream_filename = argv[1];
+  int step = atoi(argv[2]);
+  const char * png_filename_format = argc == 4 ? argv[3] : "./img%03d_decoded.png";
+
+  struct Image * img = frame_stream_decode(stream_filename, step);
+  if (img == NULL)
+    exit(1);
+
+  save_img_as_png(img, png_filename_format, step);
+  free_img(img);
+
+  return 0;
+}
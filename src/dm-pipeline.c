@@ -0,0 +1,219 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "checkpoint.h"
+#include "frame-stream.h"
+#include "live-metrics.h"
+#include "pipeline.h"
+#include "stats-sink.h"
+#include "tasks.h"
+#include "trace.h"
+
+// Même traitement que dm-base, décrit une seule fois sous forme de graphe
+// d'étapes ; l'exécuteur est choisi avec DM_EXECUTOR (seq, stages ou pool).
+// Les données de l'étape k sont dans l'emplacement k % window.
+
+struct Context {
+  int save_img;
+  const char *png_filename_format;
+  struct FrameStream *stream;
+  struct StatsSink *stats_sink;
+  struct TrajCache *traj;
+  double dt;                     // d'une sous-étape (DM_SUBSTEPS)
+  int substeps;
+
+  struct Body bodies[N_BODIES];  // état courant, modifié uniquement par stage_simulate
+  int window;
+  struct Body (*positions)[N_BODIES];
+  struct Image **img1;
+  struct Image **img2;
+  struct ImageStats *stats;
+  struct LiveProgress progress;  // DM_METRICS_FILE
+};
+
+static void stage_simulate(void *arg, int step) {
+  struct Context *ctx = arg;
+  if (ctx->traj == NULL || !traj_cache_read(ctx->traj, step, ctx->bodies)) {
+    simulate_substeps(ctx->bodies, N_BODIES, ctx->dt, ctx->substeps);
+    if (ctx->traj != NULL)
+      traj_cache_append(ctx->traj, step, ctx->bodies);
+  }
+  memcpy(ctx->positions[step % ctx->window], ctx->bodies, sizeof(ctx->bodies));
+  atomic_store_explicit(&ctx->progress.steps_started, step + 1, memory_order_relaxed);
+}
+
+static void stage_generate(void *arg, int step) {
+  struct Context *ctx = arg;
+  int slot = step % ctx->window;
+  generate_image_from_bodies(ctx->positions[slot], N_BODIES, ctx->img1[slot]);
+}
+
+static void stage_blur(void *arg, int step) {
+  struct Context *ctx = arg;
+  int slot = step % ctx->window;
+  apply_gaussian_blur(ctx->img1[slot], ctx->img2[slot]);
+}
+
+static void stage_save_img(void *arg, int step) {
+  struct Context *ctx = arg;
+  int slot = step % ctx->window;
+  if (ctx->save_img == 1)
+    save_img_as_png(ctx->img2[slot], ctx->png_filename_format, step);
+  else if (ctx->save_img == 2)
+    frame_stream_write(ctx->stream, ctx->img2[slot], step);
+}
+
+static void stage_gray(void *arg, int step) {
+  struct Context *ctx = arg;
+  int slot = step % ctx->window;
+  convert_to_grayscale(ctx->img2[slot], ctx->img1[slot]);
+}
+
+static void stage_stats(void *arg, int step) {
+  struct Context *ctx = arg;
+  int slot = step % ctx->window;
+  compute_image_statistics(ctx->img1[slot], &ctx->stats[slot]);
+}
+
+static void stage_save_stats(void *arg, int step) {
+  struct Context *ctx = arg;
+  stats_sink_push(ctx->stats_sink, &ctx->stats[step % ctx->window], step);
+  atomic_store_explicit(&ctx->progress.steps_done, step + 1, memory_order_relaxed);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 1)
+    exit(1);
+  if (argc != 5) {
+    fprintf(stderr, "usage: %s <nb-steps> <img-width> <img-height> <save-img>\n", argv[0]);
+    exit(1);
+  }
+
+  trace_open_from_env();
+  int nb_steps = atoi(argv[1]);
+  int width = atoi(argv[2]);
+  int height = atoi(argv[3]);
+  report_frame_size(width, height);
+  int save_img = atoi(argv[4]);
+
+  struct Context ctx;
+  memset(&ctx, 0, sizeof(ctx));
+  unsigned int seed = env_int("DM_SEED", 1);
+  init_bodies(ctx.bodies, seed);
+  ctx.substeps = substeps_from_env();
+  integrator_init_from_env();
+  ctx.dt = 1.0 / ctx.substeps;
+  ctx.save_img = save_img;
+
+  const char * traj_dir = getenv("DM_TRAJ_CACHE");
+  if (traj_dir != NULL)
+    ctx.traj = traj_cache_open(traj_dir, ctx.bodies, N_BODIES, seed, ctx.dt);
+
+  const char * stats_filename = "./img-stats_pipeline.csv";
+  const char * stats_bin_filename = "./img-stats_pipeline.bin";
+  const char * png_filename_format = "./img_pipeline%03d.png";
+  const char * stream_filename = "./img-frames_pipeline.dmfs";
+  ctx.png_filename_format = png_filename_format;
+
+  // clean files
+  remove(stats_filename);
+  remove(stats_bin_filename);
+  if (save_img == 2)
+    remove(stream_filename);
+  char filename[256];
+  if (save_img == 1) {
+    for (int i = 0; i < nb_steps; ++i) {
+      snprintf(filename, 256, png_filename_format, i);
+      remove(filename);
+    }
+  }
+
+  // DM_WINDOW : nombre d'étapes en cours au plus, DM_THREADS : threads de l'exécuteur pool
+  int window = env_int("DM_WINDOW", 8);
+  if (window < 1)
+    window = 1;
+  int n_threads = env_int("DM_THREADS", 4);
+  ctx.window = window;
+  ctx.positions = malloc(window * sizeof(*ctx.positions));
+  ctx.img1 = malloc(window * sizeof(struct Image *));
+  ctx.img2 = malloc(window * sizeof(struct Image *));
+  ctx.stats = malloc(window * sizeof(struct ImageStats));
+  if (ctx.positions == NULL || ctx.img1 == NULL || ctx.img2 == NULL || ctx.stats == NULL) {
+    perror("malloc");
+    exit(1);
+  }
+  account_alloc(ALLOC_BODIES, window * sizeof(*ctx.positions));
+  for (int i = 0; i < window; ++i) {
+    ctx.img1[i] = alloc_img(width, height);
+    ctx.img2[i] = alloc_img(width, height);
+  }
+
+  enum StatsFormat stats_format = stats_format_from_env();
+  ctx.stats_sink = stats_sink_open(stats_format == STATS_BIN ? stats_bin_filename : stats_filename, stats_format,
+                                   env_int("DM_STATS_FLUSH_RECORDS", 256), env_int("DM_STATS_FLUSH_MS", 1000));
+  if (save_img == 2)
+    ctx.stream = frame_stream_open(stream_filename, width, height, env_int("DM_KEYFRAME_INTERVAL", 30));
+
+  // la simulation dépend de l'étape précédente, les sauvegardes doivent rester dans l'ordre
+  struct Pipeline pipeline;
+  pipeline_init(&pipeline, window, &ctx);
+  int simulate = pipeline_add_stage(&pipeline, "simulate", stage_simulate, PIPELINE_SERIAL);
+  int generate = pipeline_add_stage(&pipeline, "generate", stage_generate, PIPELINE_PARALLEL);
+  int blur = pipeline_add_stage(&pipeline, "blur", stage_blur, PIPELINE_PARALLEL);
+  int save = pipeline_add_stage(&pipeline, "save-img", stage_save_img, save_img == 2 ? PIPELINE_SERIAL : PIPELINE_PARALLEL);
+  int gray = pipeline_add_stage(&pipeline, "gray", stage_gray, PIPELINE_PARALLEL);
+  int stats = pipeline_add_stage(&pipeline, "stats", stage_stats, PIPELINE_PARALLEL);
+  int save_stats = pipeline_add_stage(&pipeline, "save-stats", stage_save_stats, PIPELINE_SERIAL);
+
+  pipeline_add_edge(&pipeline, simulate, generate, window);
+  pipeline_add_edge(&pipeline, generate, blur, window);
+  pipeline_add_edge(&pipeline, blur, save, window);
+  pipeline_add_edge(&pipeline, blur, gray, window);
+  pipeline_add_edge(&pipeline, gray, stats, window);
+  pipeline_add_edge(&pipeline, stats, save_stats, window);
+
+  struct timespec t0, t1;
+  if (clock_gettime(CLOCK_BOOTTIME, &t0) == -1) {
+    perror("clock_gettime");
+    exit(1);
+  }
+  atomic_init(&ctx.progress.steps_started, 0);
+  atomic_init(&ctx.progress.steps_done, 0);
+  ctx.progress.stats_sink = ctx.stats_sink;
+  live_metrics_start_from_env(nb_steps, live_sample_progress, &ctx.progress);
+
+  pipeline_run(&pipeline, nb_steps, pipeline_executor_from_env(), n_threads);
+  live_metrics_stop();
+
+  if (ctx.stream != NULL)
+    frame_stream_close(ctx.stream);
+  stats_sink_close(ctx.stats_sink);
+  if (ctx.traj != NULL)
+    traj_cache_close(ctx.traj);
+
+  if (clock_gettime(CLOCK_BOOTTIME, &t1) == -1) {
+    perror("clock_gettime");
+    exit(1);
+  }
+
+  int64_t total_ns = ns_diff(&t0, &t1);
+  printf("ok\n");
+  print_elapsed_time_stats(total_ns);
+  trace_close();
+
+  pipeline_destroy(&pipeline);
+  for (int i = 0; i < window; ++i) {
+    free_img(ctx.img1[i]);
+    free_img(ctx.img2[i]);
+  }
+  free(ctx.img1);
+  free(ctx.img2);
+  free(ctx.positions);
+  account_free(ALLOC_BODIES, window * sizeof(*ctx.positions));
+  free(ctx.stats);
+
+  return 0;
+}
@@ -4,84 +4,147 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <limits.h>
 #include "tasks.h"  
+#include "stats-sink.h"
+#include "frame-stream.h"
+#include "reorder.h"
+#include "checkpoint.h"
+#include "task-queue.h"
+#include "ws-deque.h"
+#include "affinity.h"
+#include "live-metrics.h"
+#include "pipeline.h"
+#include "trace.h"
 
-#define NUM_WORKERS 4
-#define BUFFER_SIZE 100 
+#define DEFAULT_WORKERS 4
+#define BUFFER_SIZE 128 
+#define DEFAULT_WINDOW 8
 
 
 
-typedef enum {
-    TASK_SIMULATE,
-    TASK_GEN_IMAGE,
-    TASK_GAUSS_BLUR,
-    TASK_CONVERT_GRAY,
-    TASK_COMPUTE_STATS,
-    TASK_SAVE_STATS,
-    TASK_SAVE_IMG,
-    TASK_EXIT     
-} task_e;
+// Les étapes et leurs dépendances sont décrites par un graphe (pipeline.h),
+// commun à tous les scénarios : une tâche exécute une étape du graphe pour un
+// lot d'étapes de simulation, puis lance les étapes qui en dépendent.
+struct Pipeline graph;
+
+#define TASK_EXIT (-1)
 
+// Une tâche couvre les étapes [step, step + count) : pour des images petites,
+// regrouper plusieurs étapes amortit le coût des files et du comptage.
 typedef struct {
-    task_e type;
+    int stage;           // étape du graphe, TASK_EXIT pour arrêter un thread
+    int scenario;
     int step;  
+    int count;
+    int64_t queued_ns;   // DM_TRACE : mise en file, pour le temps d'attente
 } task_t;
 
+// Classe de ressource d'une tâche : calcul, encodage PNG (calcul + écriture)
+// ou écriture seule. Chaque classe a sa limite d'exécutions simultanées sur
+// les workers, ou ses propres threads, pour que les écritures bloquées sur le
+// disque n'immobilisent pas les cœurs de calcul.
+typedef enum {
+    RES_CPU,
+    RES_ENCODE,
+    RES_IO,
+    RES_COUNT
+} resource_e;
+
 typedef struct {
-    int nb_steps;
-    int save_img;
-    const char *png_filename_format;
-    const char *stats_filename;
+    const char *name;
+    int limit;                 // exécutions simultanées au plus sur les workers
+    int n_threads;             // threads dédiés (0 : exécutée par les workers)
+    atomic_int running;
+    struct TaskQueue queue;    // tâches en attente d'une place ou d'un thread dédié
+    pthread_t *threads;
+    char queue_counter[32];    // DM_TRACE
+} resource_t;
+
+resource_t resources[RES_COUNT] = {
+    [RES_CPU]    = { .name = "CPU" },
+    [RES_ENCODE] = { .name = "ENCODE" },
+    [RES_IO]     = { .name = "IO" },
+};
+
+// Classe de ressource de chaque étape du graphe
+resource_e stage_resource[PIPELINE_MAX_STAGES];
+
+// Un scénario de l'ensemble (DM_ENSEMBLE) : sa graine, ses fichiers et sa
+// fenêtre d'étapes. La simulation de l'étape k n'est lancée que lorsque
+// l'étape k - window est entièrement terminée, et les données de l'étape k
+// sont dans l'emplacement k % window.
+typedef struct {
+    int id;
+    char png_filename_format[64];
+    struct StatsSink *stats_sink;
+    struct TrajCache *traj;
+    struct FrameStream *stream;
     struct Image **img1;               
     struct Image **img2;     
     struct Body (*tabBodies)[N_BODIES];            
     struct ImageStats *stats;           
+    atomic_int *step_remaining;        // tâches restantes de chaque emplacement
+    int oldest_step;                   // plus ancienne étape non terminée
+    int parked_stage;                  // simulation en attente d'une place dans la fenêtre
+    int parked_simulate;
+    int parked_count;
+    pthread_mutex_t window_mutex;
+    _Atomic int64_t *simulated_at_ns;  // écrit par la simulation, lu par spawn
+    // Les étapes se terminent dans le désordre : les étapes PIPELINE_SERIAL
+    // autres que la simulation (écriture des statistiques et du flux) passent
+    // par un tampon de réordonnancement qui les exécute dans l'ordre des
+    // étapes. Elles ne comptent comme exécutées qu'une fois passées, pour que
+    // l'emplacement de l'étape ne soit pas réutilisé avant.
+    struct ReorderBuffer *reorder;     // indexé par étape du graphe
+} scenario_t;
+
+typedef struct {
+    int nb_steps;
+    int n_scenarios;
+    scenario_t *scenarios;
 } wargs_t;
 
 typedef struct {
-    task_t tasks[BUFFER_SIZE];
-    int in;     
-    int out;    
-    int count;  
-    pthread_mutex_t mutex;
-    pthread_cond_t not_empty;
-    pthread_cond_t not_full;
-} task_buffer_t;
-
-task_buffer_t task_buffer;
-
-void init_buffer(task_buffer_t *buf) {
-    buf->in = buf->out = buf->count = 0;
-    pthread_mutex_init(&buf->mutex, NULL);
-    pthread_cond_init(&buf->not_empty, NULL);
-    pthread_cond_init(&buf->not_full, NULL);
-}
+    int id;
+    unsigned int rng;
+    struct WsDeque deque;
+    wargs_t *w_args;
+    char deque_counter[32];    // DM_TRACE
+} worker_t;
 
+// Nombre de workers et placement : DM_WORKERS (ou 5e argument), DM_CPUS, DM_PIN.
+struct Affinity affinity;
+int num_workers = DEFAULT_WORKERS;
+worker_t *workers;
 
+// Tâches soumises depuis l'extérieur du pool (tâche initiale, arrêt).
+struct TaskQueue task_buffer;
 
-void pop(task_buffer_t *buf, task_t *task) {
-    pthread_mutex_lock(&buf->mutex);
-    while (buf->count == 0)
-        pthread_cond_wait(&buf->not_empty, &buf->mutex);
-    *task = buf->tasks[buf->out];
-    buf->out = (buf->out + 1) % BUFFER_SIZE;
-    buf->count--;
-    pthread_cond_signal(&buf->not_full);
-    pthread_mutex_unlock(&buf->mutex);
-}
+// Tâches prioritaires, regardées avant toutes les autres : la simulation
+// (chemin critique, l'étape k+1 dépend de l'étape k) et les tâches des étapes
+// en retard sur leur échéance.
+struct TaskQueue urgent_buffer;
 
-void task_p(task_buffer_t *buf, task_t task) {
-    pthread_mutex_lock(&buf->mutex);
-    while (buf->count == BUFFER_SIZE)
-        pthread_cond_wait(&buf->not_full, &buf->mutex);
-    buf->tasks[buf->in] = task;
-    buf->in = (buf->in + 1) % BUFFER_SIZE;
-    buf->count++;
-    pthread_cond_signal(&buf->not_empty);
-    pthread_mutex_unlock(&buf->mutex);
-}
+// Fenêtre d'étapes en cours de chaque scénario.
+int window = DEFAULT_WINDOW;
+int tasks_per_step = 0;
+
+// DM_DEADLINE_MS : au-delà de ce délai après sa simulation, les tâches d'une
+// étape passent dans la file prioritaire (0 : désactivé).
+int64_t deadline_ns = 0;
+
+// DM_SUBSTEPS : sous-étapes de simulation par image, de durée dt chacune.
+int substeps = 1;
+double dt = 1.0;
+
+// Workers endormis faute de tâche : ils attendent un changement de work_epoch.
+atomic_int idle_workers = 0;
+atomic_uint work_epoch = 0;
 
-int tasks_executed = 0; 
+atomic_int tasks_executed = 0; 
 
 
 int expected_tasks = 0;   
@@ -91,109 +154,388 @@ pthread_mutex_t exec_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t exec_cond = PTHREAD_COND_INITIALIZER;
 
 
+int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void notify_workers(int count);
+
+void mark_queued(task_t *task) {
+    if (trace_on)
+        task->queued_ns = trace_now();
+}
+
+// Profondeur des files, relevée au début de chaque tâche avec DM_TRACE.
+void trace_queues(worker_t *self) {
+    trace_counter("file prioritaire", task_queue_size(&urgent_buffer));
+    trace_counter("workers inactifs", atomic_load(&idle_workers));
+    for (int c = 0; c < RES_COUNT; c++)
+        trace_counter(resources[c].queue_counter, task_queue_size(&resources[c].queue));
+    if (self->deque_counter[0] != '\0')
+        trace_counter(self->deque_counter, ws_deque_size(&self->deque));
+}
+
+// Métriques en direct (DM_METRICS_FILE), relevées par un autre thread.
+atomic_int steps_simulated = 0;
+
+void sample_live(void *ctx, struct LiveSample *sample) {
+    wargs_t *w_args = ctx;
+    sample->steps_done = 0;
+    sample->io_backlog = task_queue_size(&resources[RES_IO].queue);
+    for (int k = 0; k < w_args->n_scenarios; k++) {
+        scenario_t *sc = &w_args->scenarios[k];
+        pthread_mutex_lock(&sc->window_mutex);
+        sample->steps_done += sc->oldest_step;
+        pthread_mutex_unlock(&sc->window_mutex);
+        sample->io_backlog += stats_sink_pending(sc->stats_sink);
+    }
+    sample->in_flight = atomic_load(&steps_simulated) - sample->steps_done;
+    if (sample->in_flight < 0)
+        sample->in_flight = 0;
+    sample->queue_depth = task_queue_size(&urgent_buffer) + task_queue_size(&task_buffer);
+    for (int c = 0; c < RES_COUNT; c++)
+        sample->queue_depth += task_queue_size(&resources[c].queue);
+    for (int i = 0; i < num_workers; i++)
+        sample->queue_depth += ws_deque_size(&workers[i].deque);
+}
+
+void push_urgent(int stage, int scenario, int step, int count) {
+    task_t task;
+    task.stage = stage;
+    task.scenario = scenario;
+    task.step = step;
+    task.count = count;
+    mark_queued(&task);
+    task_queue_push(&urgent_buffer, &task);
+    notify_workers(1);
+}
+
+// Taille des lots : DM_BATCH étapes par tâche, ou 0 pour l'ajuster d'après la
+// durée mesurée des tâches, de sorte qu'un lot dure au moins
+// DM_BATCH_TARGET_US. Un lot ne dépasse pas la moitié de la fenêtre, pour
+// que la simulation du lot suivant avance pendant le traitement du précédent.
+int fixed_batch = 0;
+int max_batch = 1;
+int64_t batch_target_ns = 0;
+atomic_int_fast64_t task_cost_ns[PIPELINE_MAX_STAGES];   // moyenne glissante, par étape
+
+int batch_size() {
+    if (fixed_batch > 0)
+        return fixed_batch;
+    int64_t step_ns = 0;
+    for (int stage = 0; stage < graph.n_stages; stage++)
+        step_ns += atomic_load_explicit(&task_cost_ns[stage], memory_order_relaxed);
+    if (step_ns == 0)
+        return 1;
+    int64_t batch = (batch_target_ns + step_ns - 1) / step_ns;
+    return batch < max_batch ? batch : max_batch;
+}
+
+void record_task_cost(task_t t, int64_t ns) {
+    int64_t per_step = ns / t.count;
+    int64_t old = atomic_load_explicit(&task_cost_ns[t.stage], memory_order_relaxed);
+    atomic_store_explicit(&task_cost_ns[t.stage], old == 0 ? per_step : (7 * old + per_step) / 8, memory_order_relaxed);
+}
+
+// Lance la simulation du lot qui commence à l'étape step s'il tient dans la
+// fenêtre, sinon le met de côté jusqu'à ce que les étapes d'avant se terminent.
+void schedule_simulate(scenario_t *sc, int stage, int step, int nb_steps) {
+    int count = batch_size();
+    if (count > nb_steps - step)
+        count = nb_steps - step;
+    pthread_mutex_lock(&sc->window_mutex);
+    bool ready = step + count <= sc->oldest_step + window;
+    if (!ready) {
+        sc->parked_stage = stage;
+        sc->parked_simulate = step;
+        sc->parked_count = count;
+    }
+    pthread_mutex_unlock(&sc->window_mutex);
+    if (ready)
+        push_urgent(stage, sc->id, step, count);
+}
+
+void step_completed(scenario_t *sc) {
+    int stage = 0;
+    int step = -1;
+    int count = 0;
+    pthread_mutex_lock(&sc->window_mutex);
+    while (atomic_load(&sc->step_remaining[sc->oldest_step % window]) == 0) {
+        atomic_store(&sc->step_remaining[sc->oldest_step % window], tasks_per_step);
+        sc->oldest_step++;
+    }
+    if (sc->parked_simulate >= 0 && sc->parked_simulate + sc->parked_count <= sc->oldest_step + window) {
+        stage = sc->parked_stage;
+        step = sc->parked_simulate;
+        count = sc->parked_count;
+        sc->parked_simulate = -1;
+    }
+    pthread_mutex_unlock(&sc->window_mutex);
+    if (step >= 0)
+        push_urgent(stage, sc->id, step, count);
+}
+
 // taches
-void task_executed() {
-    pthread_mutex_lock(&exec_mutex);
-    tasks_executed++;
-    if (tasks_executed == expected_tasks)
+void task_executed(scenario_t *sc, int step, int count) {
+    for (int s = step; s < step + count; s++) {
+        if (atomic_fetch_sub(&sc->step_remaining[s % window], 1) == 1)
+            step_completed(sc);
+    }
+    if (atomic_fetch_add(&tasks_executed, count) + count == expected_tasks) {
+        pthread_mutex_lock(&exec_mutex);
         pthread_cond_signal(&exec_cond);
-    pthread_mutex_unlock(&exec_mutex);
+        pthread_mutex_unlock(&exec_mutex);
+    }
+}
+
+
+void notify_workers(int count) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&idle_workers, memory_order_relaxed) > 0) {
+        atomic_fetch_add(&work_epoch, 1);
+        futex_wake(&work_epoch, count);
+    }
 }
 
+// Pousse une tâche dans la deque locale : ne bloque jamais (la deque grandit).
+// Une étape en retard sur son échéance passe par la file prioritaire.
+void spawn(worker_t *self, int stage, scenario_t *sc, int step, int count) {
+    task_t task;
+    task.stage = stage;
+    task.scenario = sc->id;
+    task.step = step;
+    task.count = count;
+    mark_queued(&task);
+    if (deadline_ns > 0 && now_ns() - atomic_load_explicit(&sc->simulated_at_ns[step % window], memory_order_relaxed) > deadline_ns
+        && task_queue_try_push(&urgent_buffer, &task)) {
+        notify_workers(1);
+        return;
+    }
+    ws_deque_push(&self->deque, &task);
+    notify_workers(1);
+}
 
-void execute_task(task_t t, wargs_t *w_args) {
+// Étapes du graphe, pour un scénario et une étape de simulation : les données
+// de l'étape k sont dans l'emplacement k % window.
+void stage_simulate(void *ctx, int step) {
+    scenario_t *sc = ctx;
+    int slot = step % window;
+    if (step > 0) {
+        int prev = (step - 1) % window;
+        for (int j = 0; j < N_BODIES; j++) {
+            sc->tabBodies[slot][j] = sc->tabBodies[prev][j];
+        }
+    }
+    if (sc->traj == NULL || !traj_cache_read(sc->traj, step, sc->tabBodies[slot])) {
+        simulate_substeps(sc->tabBodies[slot], N_BODIES, dt, substeps);
+        if (sc->traj != NULL)
+            traj_cache_append(sc->traj, step, sc->tabBodies[slot]);
+    }
+    if (deadline_ns > 0)
+        atomic_store_explicit(&sc->simulated_at_ns[slot], now_ns(), memory_order_relaxed);
+}
 
+void stage_generate(void *ctx, int step) {
+    scenario_t *sc = ctx;
+    generate_image_from_bodies(sc->tabBodies[step % window], N_BODIES, sc->img1[step % window]);
+}
+
+void stage_blur(void *ctx, int step) {
+    scenario_t *sc = ctx;
+    apply_gaussian_blur(sc->img1[step % window], sc->img2[step % window]);
+}
+
+void stage_save_img(void *ctx, int step) {
+    scenario_t *sc = ctx;
+    if (sc->stream != NULL)
+        frame_stream_write(sc->stream, sc->img2[step % window], step);
+    else
+        save_img_as_png(sc->img2[step % window], sc->png_filename_format, step);
+}
+
+void stage_gray(void *ctx, int step) {
+    scenario_t *sc = ctx;
+    convert_to_grayscale(sc->img2[step % window], sc->img1[step % window]);
+}
+
+void stage_stats(void *ctx, int step) {
+    scenario_t *sc = ctx;
+    compute_image_statistics(sc->img1[step % window], &sc->stats[step % window]);
+}
+
+void stage_save_stats(void *ctx, int step) {
+    scenario_t *sc = ctx;
+    stats_sink_push(sc->stats_sink, &sc->stats[step % window], step);
+}
+
+// La continuation d'une tâche (valeur de retour true, tâche dans *next) est
+// exécutée tout de suite par le même worker, tant que l'image est dans son
+// cache ; les autres successeurs vont dans sa deque, où ils peuvent être volés.
+bool execute_task(task_t t, worker_t *self, task_t *next) {
+    wargs_t *w_args = self->w_args;
+    scenario_t *sc = &w_args->scenarios[t.scenario];
+    bool has_next = false;
+    next->scenario = t.scenario;
+    next->step = t.step;
+    next->count = t.count;
 
     int nb_steps = w_args->nb_steps;
-    switch (t.type) {
-        case TASK_SIMULATE:
-            if (t.step == 0) {
-                simulate_n_bodies(w_args->tabBodies[0], N_BODIES, 1.0);
-            } else {
-                for (int j = 0; j < N_BODIES; j++) {
-                    w_args->tabBodies[t.step][j] = w_args->tabBodies[t.step - 1][j];
-                }
-                simulate_n_bodies(w_args->tabBodies[t.step], N_BODIES, 1.0);
-            }
-            if (t.step < nb_steps - 1) {
-                task_t next_sim;
-                next_sim.type = TASK_SIMULATE;
-                next_sim.step = t.step + 1;
-                task_p(&task_buffer, next_sim);
-            }
-            {
-                task_t gen;
-                gen.type = TASK_GEN_IMAGE;
-                gen.step = t.step;
-                task_p(&task_buffer, gen);
-            }
-            break;
-        case TASK_GEN_IMAGE:
-            generate_image_from_bodies(w_args->tabBodies[t.step], N_BODIES, w_args->img1[t.step]);
-            {
-                task_t blur;
-                blur.type = TASK_GAUSS_BLUR;
-                blur.step = t.step;
-                task_p(&task_buffer, blur);
-            }
-            break;
-        case TASK_GAUSS_BLUR:
-            apply_gaussian_blur(w_args->img1[t.step], w_args->img2[t.step]);
-            if (w_args->save_img) {
-                task_t save;
-                save.type = TASK_SAVE_IMG;
-                save.step = t.step;
-                task_p(&task_buffer, save);
-            }
-            {
-                task_t voo;
-                voo.type = TASK_CONVERT_GRAY;
-                voo.step = t.step;
-                task_p(&task_buffer, voo);
-            }
-            break;
-        case TASK_SAVE_IMG:
-            save_img_as_png(w_args->img2[t.step], w_args->png_filename_format, t.step);
-            break;
-        case TASK_CONVERT_GRAY:
-            convert_to_grayscale(w_args->img2[t.step], w_args->img1[t.step]);
-            {
-                task_t temp;
-                temp.type = TASK_COMPUTE_STATS;
-                temp.step = t.step;
-                task_p(&task_buffer, temp);
-            }
-            break;
-        case TASK_COMPUTE_STATS:
-            compute_image_statistics(w_args->img1[t.step], &w_args->stats[t.step]);
-            {
-                task_t save_stats_task;
-                save_stats_task.type = TASK_SAVE_STATS;
-                save_stats_task.step = t.step;
-                task_p(&task_buffer, save_stats_task);
-            }
-            break;
-        case TASK_SAVE_STATS:
-            save_stats(&w_args->stats[t.step], w_args->stats_filename, t.step);
-            break;
-        case TASK_EXIT:
-            break;
-        default:
-            fprintf(stderr, "Tâche inconnue\n");
-            exit(EXIT_FAILURE);
+    int last = t.step + t.count;
+    int64_t t0 = fixed_batch == 0 ? now_ns() : 0;
+    int64_t trace_begin = 0;
+    if (trace_on) {
+        trace_queues(self);
+        trace_begin = trace_now();
+    }
+    struct PipelineStage *stage = &graph.stages[t.stage];
+    bool in_order = (stage->flags & PIPELINE_SERIAL) && stage->n_in > 0;
+    for (int step = t.step; step < last; step++) {
+        if (in_order)
+            reorder_submit(&sc->reorder[t.stage], step, &t.stage);
+        else
+            stage->run(sc, step);
+    }
+    // La simulation est en série : elle lance elle-même son lot suivant.
+    if (stage->n_in == 0) {
+        atomic_fetch_add_explicit(&steps_simulated, t.count, memory_order_relaxed);
+        if (last < nb_steps)
+            schedule_simulate(sc, t.stage, last, nb_steps);
+    }
+    // Chaque étape n'a qu'une entrée : ses successeurs sont prêts. Le premier
+    // est la continuation.
+    for (int i = 1; i < stage->n_out; i++)
+        spawn(self, stage->out[i].to, sc, t.step, t.count);
+    if (stage->n_out > 0) {
+        next->stage = stage->out[0].to;
+        has_next = true;
+    }
+    if (fixed_batch == 0 && t.count > 0)
+        record_task_cost(t, now_ns() - t0);
+    if (trace_on)
+        trace_span(stage->name, trace_begin, trace_now(), t.step, t.count, trace_begin - t.queued_ns);
+    if (!in_order)
+        task_executed(sc, t.step, t.count);
+    return has_next;
+}
+
+// Étape en série sortie du tampon de réordonnancement (elem : son indice)
+void commit_in_order(void *ctx, const void *elem, int step) {
+    scenario_t *sc = ctx;
+    graph.stages[*(const int *)elem].run(sc, step);
+    task_executed(sc, step, 1);
+}
+
+// Prend une place dans la classe de la tâche. Sinon la tâche est confiée aux
+// threads de la classe, ou attend dans sa file qu'une place se libère.
+bool acquire_resource(task_t t) {
+    resource_t *r = &resources[stage_resource[t.stage]];
+    if (r->n_threads == 0) {
+        int running = atomic_load(&r->running);
+        while (running < r->limit) {
+            if (atomic_compare_exchange_weak(&r->running, &running, running + 1))
+                return true;
+        }
+    }
+    mark_queued(&t);
+    task_queue_push(&r->queue, &t);
+    if (r->n_threads == 0)
+        notify_workers(1);
+    return false;
+}
+
+void release_resource(task_t t) {
+    resource_t *r = &resources[stage_resource[t.stage]];
+    atomic_fetch_sub(&r->running, 1);
+    if (task_queue_size(&r->queue) > 0)
+        notify_workers(1);
+}
+
+// File prioritaire, tâches en attente d'une place libérée, deque locale
+// (LIFO), puis tâches externes, puis vol (FIFO, donc les étapes les plus
+// anciennes d'abord) chez les autres workers en partant d'une victime tirée
+// au hasard.
+bool try_get_task(worker_t *self, task_t *t) {
+    if (task_queue_try_pop(&urgent_buffer, t))
+        return true;
+    for (int c = 0; c < RES_COUNT; c++) {
+        resource_t *r = &resources[c];
+        if (r->n_threads == 0 && atomic_load(&r->running) < r->limit && task_queue_try_pop(&r->queue, t))
+            return true;
+    }
+    if (ws_deque_take(&self->deque, t))
+        return true;
+    if (task_queue_try_pop(&task_buffer, t))
+        return true;
+
+    self->rng = self->rng * 1103515245 + 12345;
+    int start = (self->rng >> 16) % num_workers;
+    for (int i = 0; i < num_workers; i++) {
+        worker_t *victim = &workers[(start + i) % num_workers];
+        if (victim != self && ws_deque_steal(&victim->deque, t))
+            return true;
     }
-    task_executed();
+    return false;
 }
 
+// Renvoie false quand le worker doit s'arrêter.
+bool find_task(worker_t *self, task_t *t) {
+    for (;;) {
+        if (try_get_task(self, t))
+            return t->stage != TASK_EXIT;
+
+        // S'annoncer inactif avant de revérifier : une tâche poussée entre
+        // temps est soit vue ici, soit suivie d'un réveil (notify_workers).
+        atomic_fetch_add(&idle_workers, 1);
+        unsigned int epoch = atomic_load(&work_epoch);
+        if (try_get_task(self, t)) {
+            atomic_fetch_sub(&idle_workers, 1);
+            return t->stage != TASK_EXIT;
+        }
+        futex_wait(&work_epoch, epoch);
+        atomic_fetch_sub(&idle_workers, 1);
+    }
+}
 
 void *worker_func(void *arg) {
-    wargs_t *w_args = (wargs_t *) arg;
-    while (1) {
-        task_t t;
-        pop(&task_buffer, &t);
-        if (t.type == TASK_EXIT)
+    worker_t *self = (worker_t *) arg;
+    affinity_pin_self(&affinity, self->id);
+    char name[32];
+    snprintf(name, sizeof(name), "worker %d", self->id);
+    trace_thread_name(name);
+    task_t t;
+    task_t next;
+    while (find_task(self, &t)) {
+        // Une tâche prioritaire passe avant la continuation, qui reste
+        // disponible dans la deque.
+        while (acquire_resource(t)) {
+            bool has_next = execute_task(t, self, &next);
+            release_resource(t);
+            if (!has_next)
+                break;
+            mark_queued(&next);
+            if (task_queue_try_pop(&urgent_buffer, &t)) {
+                ws_deque_push(&self->deque, &next);
+                notify_workers(1);
+            } else
+                t = next;
+        }
+    }
+    return NULL;
+}
+
+// Thread dédié d'une classe : ses tâches n'ont pas de successeur.
+void *resource_thread_func(void *arg) {
+    worker_t *self = (worker_t *) arg;
+    resource_t *r = &resources[self->id];
+    trace_thread_name(r->name);
+    task_t t, next;
+    for (;;) {
+        task_queue_pop(&r->queue, &t);
+        if (t.stage == TASK_EXIT)
             break;
-        execute_task(t, w_args);
+        execute_task(t, self, &next);
     }
     return NULL;
 }
@@ -201,109 +543,264 @@ void *worker_func(void *arg) {
 
 
 void freeAll_resources(wargs_t *w_args) {
-    for (int i = 0; i < w_args->nb_steps; i++) {
-        free_img(w_args->img1[i]);
-        free_img(w_args->img2[i]);
-    }
-    free(w_args->tabBodies);
-    free(w_args->img1);
-    free(w_args->img2);
-    free(w_args->stats);
+    for (int k = 0; k < w_args->n_scenarios; k++) {
+        scenario_t *sc = &w_args->scenarios[k];
+        for (int i = 0; i < window; i++) {
+            free_img(sc->img1[i]);
+            free_img(sc->img2[i]);
+        }
+        free(sc->tabBodies);
+        account_free(ALLOC_BODIES, window * sizeof(struct Body[N_BODIES]));
+        free(sc->img1);
+        free(sc->img2);
+        free(sc->stats);
+        free(sc->step_remaining);
+        free(sc->simulated_at_ns);
+        pthread_mutex_destroy(&sc->window_mutex);
+    }
+    free(w_args->scenarios);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "usage: %s <nb-steps> <img-width> <img-height> <save-img>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-    
-    int nb_steps = atoi(argv[1]);
-    int width    = atoi(argv[2]);
-    int height   = atoi(argv[3]);
-    int save_img = atoi(argv[4]);
-    
-    const char *stats_filename = "./img-stats_v2.csv";
-    const char *png_filename_format = "./img%03d_v2.png";
-    
+// Fichiers, emplacements et état de départ du scénario k. Avec un seul
+// scénario, les fichiers gardent leur nom habituel ; sinon ils prennent le
+// suffixe _s<k>.
+void init_scenario(scenario_t *sc, int k, int n_scenarios, unsigned int seed, int nb_steps, int width, int height,
+                   int save_img) {
+    char suffix[16] = "";
+    if (n_scenarios > 1)
+        snprintf(suffix, sizeof(suffix), "_s%d", k);
+    char stats_filename[64], stats_bin_filename[64], stream_filename[64];
+    snprintf(stats_filename, sizeof(stats_filename), "./img-stats_v2%s.csv", suffix);
+    snprintf(stats_bin_filename, sizeof(stats_bin_filename), "./img-stats_v2%s.bin", suffix);
+    snprintf(stream_filename, sizeof(stream_filename), "./img-frames_v2%s.dmfs", suffix);
+    snprintf(sc->png_filename_format, sizeof(sc->png_filename_format), "./img%%03d_v2%s.png", suffix);
+    sc->id = k;
+
     // Suppression
     remove(stats_filename);
-    if (save_img) {
+    remove(stats_bin_filename);
+    if (save_img == 2)
+        remove(stream_filename);
+    if (save_img == 1) {
         char filename[256];
         for (int i = 0; i < nb_steps; i++) {
-            snprintf(filename, sizeof(filename), png_filename_format, i);
+            snprintf(filename, sizeof(filename), sc->png_filename_format, i);
             remove(filename);
         }
     }
-    
-    wargs_t w_args;
-    w_args.nb_steps = nb_steps;
-    w_args.save_img = save_img;
-    w_args.png_filename_format = png_filename_format;
-    w_args.stats_filename = stats_filename;
-   
-    w_args.tabBodies = malloc(nb_steps * sizeof(struct Body[N_BODIES]));
-    if (w_args.tabBodies == NULL) {
+
+    enum StatsFormat stats_format = stats_format_from_env();
+    sc->stats_sink = stats_sink_open(stats_format == STATS_BIN ? stats_bin_filename : stats_filename, stats_format,
+                                     env_int("DM_STATS_FLUSH_RECORDS", 256), env_int("DM_STATS_FLUSH_MS", 1000));
+    sc->stream = NULL;
+    if (save_img == 2)
+        sc->stream = frame_stream_open(stream_filename, width, height, env_int("DM_KEYFRAME_INTERVAL", 30));
+
+    sc->tabBodies = malloc(window * sizeof(struct Body[N_BODIES]));
+    if (sc->tabBodies == NULL) {
         fprintf(stderr, "Erreur lors de l'allocation de tabBodies\n");
         exit(EXIT_FAILURE);
     }
+    account_alloc(ALLOC_BODIES, window * sizeof(struct Body[N_BODIES]));
     
-    w_args.img1 = malloc(nb_steps * sizeof(struct Image *));
-    w_args.img2 = malloc(nb_steps * sizeof(struct Image *));
+    sc->img1 = malloc(window * sizeof(struct Image *));
+    sc->img2 = malloc(window * sizeof(struct Image *));
     
-    for (int i = 0; i < nb_steps; i++) {
-        w_args.img1[i] = alloc_img(width, height);
-        if (w_args.img1[i] == NULL) {
+    // L'emplacement i est associé à un worker, à tour de rôle sur tous les
+    // scénarios : ses pages sont placées de préférence sur le nœud NUMA du
+    // CPU de ce worker.
+    for (int i = 0; i < window; i++) {
+        int node = affinity_node_of(&affinity, (k * window + i) % num_workers);
+        sc->img1[i] = alloc_img_on_node(width, height, node);
+        if (sc->img1[i] == NULL) {
             fprintf(stderr, "Erreur allocation de img1[%d]\n", i);
             exit(EXIT_FAILURE);
         }
-        w_args.img2[i] = alloc_img(width, height);
-        if (w_args.img2[i] == NULL) {
+        sc->img2[i] = alloc_img_on_node(width, height, node);
+        if (sc->img2[i] == NULL) {
             fprintf(stderr, "Erreur allocation de img2[%d]\n", i);
             exit(EXIT_FAILURE);
         }
     }
     
-    w_args.stats = malloc(nb_steps * sizeof(struct ImageStats));
-    if (w_args.stats == NULL) {
+    sc->stats = malloc(window * sizeof(struct ImageStats));
+    if (sc->stats == NULL) {
         fprintf(stderr, "Erreur allocation de stats\n");
         exit(EXIT_FAILURE);
     }
     
-    struct Body bodies[N_BODIES] = {
-        { 0.00, 0.0,  0.000, 0.0,      1.0, 0.00465047,  5.0e2, 255, 204,  0},
-        { 0.39, 0.0,  0.323, 0.0, 1.65e-7,  1.765e-5, 10.0e3, 169, 169,169},
-        { 0.72, 0.0,  0.218, 0.0, 2.45e-6,  4.552e-5, 10.0e3, 255, 204,153},
-        { 1.00, 0.0,  0.170, 0.0, 3.00e-6,  4.258e-5, 10.0e3,   0, 102,204},
-        { 1.52, 0.0,  0.128, 0.0, 3.21e-7,  2.279e-5, 10.0e3, 255, 102,  0},
-        { 5.20, 0.0,  0.060, 0.0, 9.55e-4,  4.7789e-4,  5.0e3, 204, 153,102},
-        { 9.58, 0.0,  0.043, 0.0, 2.86e-4,  4.0072e-4,  5.0e3, 210, 180,140},
-        {19.22, 0.0,  0.030, 0.0, 4.36e-5,  1.6938e-4,  5.0e3, 173, 216,230},
-        {30.05, 0.0,  0.024, 0.0, 5.17e-5,  1.6418e-4,  5.0e3,   0,   0,128},
-    };
-    srand(1);
-    for (int i = 1; i < N_BODIES; i++) {
-        double dist = bodies[i].x;
-        double angle = 2 * M_PI * (double)rand() / RAND_MAX;
-        bodies[i].x = dist * cos(angle);
-        bodies[i].y = dist * sin(angle);
-        double rot_speed = bodies[i].vx;
-        bodies[i].vx = -rot_speed * bodies[i].y;
-        bodies[i].vy =  rot_speed * bodies[i].x;
-    }
+    struct Body bodies[N_BODIES];
+    init_bodies(bodies, seed);
+    const char *traj_dir = getenv("DM_TRAJ_CACHE");
+    sc->traj = traj_dir != NULL ? traj_cache_open(traj_dir, bodies, N_BODIES, seed, dt) : NULL;
     for (int i = 0; i < N_BODIES; i++) {
-        w_args.tabBodies[0][i] = bodies[i];
+        sc->tabBodies[0][i] = bodies[i];
     }
     
-    if (w_args.save_img)
-        expected_tasks = nb_steps * 7;
-    else
-        expected_tasks = nb_steps * 6;
+    sc->step_remaining = malloc(window * sizeof(atomic_int));
+    sc->simulated_at_ns = malloc(window * sizeof(_Atomic int64_t));
+    if (sc->step_remaining == NULL || sc->simulated_at_ns == NULL) {
+        fprintf(stderr, "Erreur allocation de la fenêtre\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < window; i++) {
+        atomic_init(&sc->step_remaining[i], tasks_per_step);
+        atomic_init(&sc->simulated_at_ns[i], 0);
+    }
+    sc->oldest_step = 0;
+    sc->parked_stage = 0;
+    sc->parked_simulate = -1;
+    sc->parked_count = 0;
+    pthread_mutex_init(&sc->window_mutex, NULL);
     
-    init_buffer(&task_buffer);
+    // Au plus window étapes sont en cours, les tampons ne bloquent donc jamais.
+    sc->reorder = calloc(graph.n_stages, sizeof(struct ReorderBuffer));
+    if (sc->reorder == NULL) {
+        fprintf(stderr, "Erreur allocation des tampons de réordonnancement\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int s = 0; s < graph.n_stages; s++) {
+        if ((graph.stages[s].flags & PIPELINE_SERIAL) && graph.stages[s].n_in > 0)
+            reorder_init(&sc->reorder[s], window, sizeof(int), 0, commit_in_order, sc);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 5 && argc != 6) {
+        fprintf(stderr, "usage: %s <nb-steps> <img-width> <img-height> <save-img> [nb-workers]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
     
-    pthread_t workers[NUM_WORKERS];
-    for (int i = 0; i < NUM_WORKERS; i++) {
-        if (pthread_create(&workers[i], NULL, worker_func, (void *)&w_args) != 0) {
+    trace_open_from_env();
+    int nb_steps = atoi(argv[1]);
+    int width    = atoi(argv[2]);
+    int height   = atoi(argv[3]);
+    report_frame_size(width, height);
+    int save_img = atoi(argv[4]);
+    
+    // DM_ENSEMBLE : nombre de scénarios exécutés ensemble, de graines
+    // DM_SEED, DM_SEED + 1...
+    wargs_t w_args;
+    w_args.nb_steps = nb_steps;
+    w_args.n_scenarios = env_int("DM_ENSEMBLE", 1);
+    if (w_args.n_scenarios < 1)
+        w_args.n_scenarios = 1;
+    w_args.scenarios = calloc(w_args.n_scenarios, sizeof(scenario_t));
+    if (w_args.scenarios == NULL) {
+        fprintf(stderr, "Erreur allocation des scénarios\n");
+        exit(EXIT_FAILURE);
+    }
+   
+    affinity_from_env(&affinity, DEFAULT_WORKERS, argc == 6 ? argv[5] : NULL);
+    num_workers = affinity.n_workers;
+    if (num_workers < 1) {
+        fprintf(stderr, "Nombre de workers invalide\n");
+        exit(EXIT_FAILURE);
+    }
+    
+    // DM_WINDOW : nombre d'étapes en cours au plus par scénario, les images sont allouées par emplacement
+    window = env_int("DM_WINDOW", DEFAULT_WINDOW);
+    if (window < 1)
+        window = 1;
+    deadline_ns = env_int("DM_DEADLINE_MS", 0) * 1000000LL;
+    substeps = substeps_from_env();
+    integrator_init_from_env();
+    dt = 1.0 / substeps;
+
+    // DM_BATCH : étapes par tâche (0 : ajusté d'après la durée des tâches)
+    fixed_batch = env_int("DM_BATCH", 0);
+    max_batch = window / 2 > 1 ? window / 2 : 1;
+    if (fixed_batch > max_batch)
+        fixed_batch = max_batch;
+    batch_target_ns = env_int("DM_BATCH_TARGET_US", 50) * 1000LL;
+    for (int stage = 0; stage < PIPELINE_MAX_STAGES; stage++)
+        atomic_init(&task_cost_ns[stage], 0);
+
+    // Graphe des étapes, la continuation de chaque étape est sa première
+    // arête. Les capacités ne servent pas ici : seule la fenêtre limite les
+    // étapes en cours.
+    pipeline_init(&graph, window, NULL);
+    int simulate = pipeline_add_stage(&graph, "simulate", stage_simulate, PIPELINE_SERIAL);
+    int generate = pipeline_add_stage(&graph, "generate", stage_generate, PIPELINE_PARALLEL);
+    int blur = pipeline_add_stage(&graph, "blur", stage_blur, PIPELINE_PARALLEL);
+    int gray = pipeline_add_stage(&graph, "gray", stage_gray, PIPELINE_PARALLEL);
+    int stats = pipeline_add_stage(&graph, "stats", stage_stats, PIPELINE_PARALLEL);
+    int save_stats = pipeline_add_stage(&graph, "save-stats", stage_save_stats, PIPELINE_SERIAL);
+    pipeline_add_edge(&graph, simulate, generate, window);
+    pipeline_add_edge(&graph, generate, blur, window);
+    pipeline_add_edge(&graph, blur, gray, window);
+    pipeline_add_edge(&graph, gray, stats, window);
+    pipeline_add_edge(&graph, stats, save_stats, window);
+    for (int s = 0; s < graph.n_stages; s++)
+        stage_resource[s] = RES_CPU;
+    stage_resource[save_stats] = RES_IO;
+    if (save_img) {
+        int save = pipeline_add_stage(&graph, "save-img", stage_save_img, save_img == 2 ? PIPELINE_SERIAL : PIPELINE_PARALLEL);
+        pipeline_add_edge(&graph, blur, save, window);
+        stage_resource[save] = RES_ENCODE;
+    }
+
+    for (int s = 0; s < graph.n_stages; s++) {
+        if (graph.stages[s].n_in > 1) {
+            fprintf(stderr, "Étape %s : une seule entrée possible\n", graph.stages[s].name);
+            exit(EXIT_FAILURE);
+        }
+    }
+    tasks_per_step = graph.n_stages;
+    expected_tasks = w_args.n_scenarios * nb_steps * tasks_per_step;
+    
+    unsigned int seed = env_int("DM_SEED", 1);
+    for (int k = 0; k < w_args.n_scenarios; k++)
+        init_scenario(&w_args.scenarios[k], k, w_args.n_scenarios, seed + k, nb_steps, width, height, save_img);
+    
+    task_queue_init(&task_buffer, BUFFER_SIZE, sizeof(task_t));
+    int max_in_flight = w_args.n_scenarios * window * tasks_per_step;
+    task_queue_init(&urgent_buffer, max_in_flight + 1, sizeof(task_t));
+    
+    // DM_<CLASSE>_LIMIT : exécutions simultanées sur les workers,
+    // DM_<CLASSE>_THREADS : threads dédiés (remplace la limite)
+    resources[RES_CPU].limit = env_int("DM_CPU_LIMIT", num_workers);
+    resources[RES_ENCODE].limit = env_int("DM_ENCODE_LIMIT", num_workers / 2);
+    resources[RES_ENCODE].n_threads = env_int("DM_ENCODE_THREADS", 0);
+    resources[RES_IO].limit = env_int("DM_IO_LIMIT", 1);
+    resources[RES_IO].n_threads = env_int("DM_IO_THREADS", 1);
+    worker_t resource_workers[RES_COUNT];
+    for (int c = 0; c < RES_COUNT; c++) {
+        resource_t *r = &resources[c];
+        if (r->limit < 1)
+            r->limit = 1;
+        if (c == RES_CPU || r->n_threads < 0)
+            r->n_threads = 0;
+        atomic_init(&r->running, 0);
+        snprintf(r->queue_counter, sizeof(r->queue_counter), "file %s", r->name);
+        task_queue_init(&r->queue, max_in_flight + r->n_threads + 1, sizeof(task_t));
+        r->threads = malloc(r->n_threads * sizeof(pthread_t));
+        resource_workers[c].id = c;
+        resource_workers[c].w_args = &w_args;
+        resource_workers[c].deque_counter[0] = '\0';
+        for (int i = 0; i < r->n_threads; i++) {
+            if (pthread_create(&r->threads[i], NULL, resource_thread_func, (void *)&resource_workers[c]) != 0) {
+                fprintf(stderr, "Erreur lors de la création d'un thread %s\n", r->name);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    
+    workers = calloc(num_workers, sizeof(worker_t));
+    pthread_t *threads = malloc(num_workers * sizeof(pthread_t));
+    if (workers == NULL || threads == NULL) {
+        fprintf(stderr, "Erreur allocation des workers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        workers[i].id = i;
+        workers[i].rng = i + 1;
+        workers[i].w_args = &w_args;
+        ws_deque_init(&workers[i].deque, 64, sizeof(task_t));
+        snprintf(workers[i].deque_counter, sizeof(workers[i].deque_counter), "deque worker %d", i);
+    }
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(&threads[i], NULL, worker_func, (void *)&workers[i]) != 0) {
             fprintf(stderr, "Erreur lors de la création du thread %d\n", i);
             exit(EXIT_FAILURE);
         }
@@ -315,25 +812,70 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
     
-    task_t init_task;
-    init_task.type = TASK_SIMULATE;
-    init_task.step = 0;
-    task_p(&task_buffer, init_task);
+    live_metrics_start_from_env(w_args.n_scenarios * nb_steps, sample_live, &w_args);
+
+    for (int k = 0; k < w_args.n_scenarios; k++) {
+        task_t init_task;
+        init_task.stage = simulate;
+        init_task.scenario = k;
+        init_task.step = 0;
+        init_task.count = batch_size() < nb_steps ? batch_size() : nb_steps;
+        mark_queued(&init_task);
+        task_queue_push(&task_buffer, &init_task);
+        notify_workers(1);
+    }
     
     pthread_mutex_lock(&exec_mutex);
     while (tasks_executed < expected_tasks)
         pthread_cond_wait(&exec_cond, &exec_mutex);
     pthread_mutex_unlock(&exec_mutex);
+    live_metrics_stop();
     
-    for (int i = 0; i < NUM_WORKERS; i++) {
+    for (int i = 0; i < num_workers; i++) {
         task_t exit_task;
-        exit_task.type = TASK_EXIT;
-        exit_task.step = 0; 
-        task_p(&task_buffer, exit_task);
+        exit_task.stage = TASK_EXIT;
+        exit_task.scenario = 0;
+        exit_task.step = 0;
+        exit_task.count = 0;
+        task_queue_push(&task_buffer, &exit_task);
     }
+    notify_workers(INT_MAX);
     
-    for (int i = 0; i < NUM_WORKERS; i++) {
-        pthread_join(workers[i], NULL);
+    for (int i = 0; i < num_workers; i++) {
+        pthread_join(threads[i], NULL);
+        ws_deque_destroy(&workers[i].deque);
+    }
+    free(threads);
+    free(workers);
+    for (int c = 0; c < RES_COUNT; c++) {
+        resource_t *r = &resources[c];
+        for (int i = 0; i < r->n_threads; i++) {
+            task_t exit_task;
+            exit_task.stage = TASK_EXIT;
+            exit_task.scenario = 0;
+            exit_task.step = 0;
+            exit_task.count = 0;
+            task_queue_push(&r->queue, &exit_task);
+        }
+        for (int i = 0; i < r->n_threads; i++)
+            pthread_join(r->threads[i], NULL);
+        free(r->threads);
+        task_queue_destroy(&r->queue);
+    }
+    task_queue_destroy(&task_buffer);
+    task_queue_destroy(&urgent_buffer);
+    for (int k = 0; k < w_args.n_scenarios; k++) {
+        scenario_t *sc = &w_args.scenarios[k];
+        for (int s = 0; s < graph.n_stages; s++) {
+            if ((graph.stages[s].flags & PIPELINE_SERIAL) && graph.stages[s].n_in > 0)
+                reorder_destroy(&sc->reorder[s]);
+        }
+        free(sc->reorder);
+        if (sc->stream != NULL)
+            frame_stream_close(sc->stream);
+        stats_sink_close(sc->stats_sink);
+        if (sc->traj != NULL)
+            traj_cache_close(sc->traj);
     }
     
     if (clock_gettime(CLOCK_BOOTTIME, &t1_time) == -1) {
@@ -342,8 +884,10 @@ int main(int argc, char *argv[]) {
     }
     int64_t total_ns = ns_diff(&t0_time, &t1_time);
     print_elapsed_time_stats(total_ns);
+    trace_close();
     
     freeAll_resources(&w_args);
+    pipeline_destroy(&graph);
     
     return 0;
 }
\ No newline at end of file
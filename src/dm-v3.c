@@ -1,139 +1,228 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <pthread.h>
-#include "tasks-v3.h"
-
-#define NUM_THREADS 4 // Nombre de threads à utiliser
-
-// Structure pour passer des arguments aux threads
-struct ThreadArgs {
+#include "tasks.h"
+#include "affinity.h"
+#include "checkpoint.h"
+#include "frame-stream.h"
+#include "live-metrics.h"
+#include "metrics.h"
+#include "stats-sink.h"
+#include "thread-pool.h"
+#include "trace.h"
+
+#define DEFAULT_THREADS 4 // Nombre de threads par défaut (DM_WORKERS ou 5e argument)
+
+// Taille minimale d'un morceau : en dessous, découper coûte plus que ça ne rapporte
+#define GRAIN_BODIES 16
+#define GRAIN_ROWS 8
+
+// Les étapes s'exécutent l'une après l'autre, chacune répartie par plages de
+// lignes (ou de corps) sur les threads du pool, qui restent en vie d'une étape
+// à l'autre. Le temps d'une étape est mesuré par le thread principal, ses
+// compteurs matériels (DM_PERF) par chaque plage.
+struct StepArgs {
     struct Body *bodies;
-    int n;
     double dt;
     struct Image *img1;
     struct Image *img2;
-    struct ImageStats *stats;
-    int current_step;
-    int save_img;
-    const char *png_filename_format;
-    const char *stats_filename;
+    int histogram[256];
+    pthread_mutex_t histogram_mutex;
 };
 
-// Fonction exécutée par chaque thread
-void *thread_function(void *args) {
-    struct ThreadArgs *targs = (struct ThreadArgs *)args;
-
-    // Simuler les corps célestes
-    simulate_n_bodies(targs->bodies, targs->n, targs->dt);
+void velocities_range(void *p, int begin, int end) {
+    struct StepArgs *args = p;
+    METRICS_COUNTERS_SCOPE(NBODIES_SIMULATION);
+    simulate_n_bodies_velocities(args->bodies, N_BODIES, args->dt, begin, end);
+}
 
-    // Générer l'image à partir des corps
-    generate_image_from_bodies(targs->bodies, targs->n, targs->img1);
+void generate_range(void *p, int y0, int y1) {
+    struct StepArgs *args = p;
+    METRICS_COUNTERS_SCOPE(IMAGE_GENERATION);
+    generate_image_rows(args->bodies, N_BODIES, args->img1, y0, y1);
+}
 
-    // Appliquer le flou gaussien
-    apply_gaussian_blur(targs->img1, targs->img2);
+void blur_range(void *p, int y0, int y1) {
+    struct StepArgs *args = p;
+    METRICS_COUNTERS_SCOPE(IMAGE_GAUSSIAN_BLUR);
+    apply_gaussian_blur_rows(args->img1, args->img2, y0, y1);
+}
 
-    // Sauvegarder l'image si nécessaire
-    if (targs->save_img)
-        save_img_as_png(targs->img2, targs->png_filename_format, targs->current_step);
+void grayscale_range(void *p, int y0, int y1) {
+    struct StepArgs *args = p;
+    METRICS_COUNTERS_SCOPE(IMAGE_GRAYSCALE);
+    convert_to_grayscale_rows(args->img2, args->img1, y0, y1);
+}
 
-    // Convertir en niveaux de gris
-    convert_to_grayscale(targs->img2, targs->img1);
+// Histogramme local à la plage, ajouté ensuite à celui de l'image
+void histogram_range(void *p, int y0, int y1) {
+    struct StepArgs *args = p;
+    METRICS_COUNTERS_SCOPE(IMAGE_STATS);
+    int histogram[256] = {0};
+    accumulate_histogram_rows(args->img1, histogram, y0, y1);
+    pthread_mutex_lock(&args->histogram_mutex);
+    for (int i = 0; i < 256; i++)
+        args->histogram[i] += histogram[i];
+    pthread_mutex_unlock(&args->histogram_mutex);
+}
 
-    // Calculer les statistiques de l'image
-    compute_image_statistics(targs->img1, targs->stats);
+static struct MetricsTimer stage_timer;
 
-    // Sauvegarder les statistiques
-    save_stats(targs->stats, targs->stats_filename, targs->current_step);
+// Mesuré par le thread principal : durée réelle de l'étape, pas la somme des
+// temps des threads, et temps CPU de tout le processus pendant l'étape
+void stage_begin(enum Step step) {
+    metrics_begin_process(&stage_timer, step);
+}
 
-    pthread_exit(NULL);
+void stage_end() {
+    metrics_end(&stage_timer);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
-        fprintf(stderr, "usage: %s <nb-steps> <img-width> <img-height> <save-img>\n", argv[0]);
+    if (argc != 5 && argc != 6) {
+        fprintf(stderr, "usage: %s <nb-steps> <img-width> <img-height> <save-img> [nb-threads]\n", argv[0]);
         exit(1);
     }
 
+    trace_open_from_env();
     int nb_steps = atoi(argv[1]);
     int width = atoi(argv[2]);
     int height = atoi(argv[3]);
+    report_frame_size(width, height);
     int save_img = atoi(argv[4]);
 
-    struct Body bodies[N_BODIES] = {
-        {0.00, 0.0, 0.000, 0.0, 1.0, 0.00465047, 5.0e2, 255, 204, 0},
-        {0.39, 0.0, 0.323, 0.0, 1.65e-7, 1.765e-5, 10.0e3, 169, 169, 169},
-        {0.72, 0.0, 0.218, 0.0, 2.45e-6, 4.552e-5, 10.0e3, 255, 204, 153},
-        {1.00, 0.0, 0.170, 0.0, 3.00e-6, 4.258e-5, 10.0e3, 0, 102, 204},
-        {1.52, 0.0, 0.128, 0.0, 3.21e-7, 2.279e-5, 10.0e3, 255, 102, 0},
-        {5.20, 0.0, 0.060, 0.0, 9.55e-4, 4.7789e-4, 5.0e3, 204, 153, 102},
-        {9.58, 0.0, 0.043, 0.0, 2.86e-4, 4.0072e-4, 5.0e3, 210, 180, 140},
-        {19.22, 0.0, 0.030, 0.0, 4.36e-5, 1.6938e-4, 5.0e3, 173, 216, 230},
-        {30.05, 0.0, 0.024, 0.0, 5.17e-5, 1.6418e-4, 5.0e3, 0, 0, 128},
-    };
-
-    srand(1);
+    struct Body bodies[N_BODIES];
+    unsigned int seed = env_int("DM_SEED", 1);
+    init_bodies(bodies, seed);
+    int substeps = substeps_from_env();
+    integrator_init_from_env();
+    const double dt = 1.0 / substeps;
 
-    for (int i = 1; i < N_BODIES; ++i) {
-        double dist = bodies[i].x;
-        double angle = 2 * M_PI * (double)rand() / RAND_MAX;
-        bodies[i].x = dist * cos(angle);
-        bodies[i].y = dist * sin(angle);
+    const char *traj_dir = getenv("DM_TRAJ_CACHE");
+    struct TrajCache *traj = NULL;
+    if (traj_dir != NULL)
+        traj = traj_cache_open(traj_dir, bodies, N_BODIES, seed, dt);
 
-        double rot_speed = bodies[i].vx;
-        bodies[i].vx = -rot_speed * bodies[i].y;
-        bodies[i].vy = rot_speed * bodies[i].x;
-    }
-
-    const char *stats_filename = "./img-stats.csv";
-    const char *png_filename_format = "./img%03d.png";
+    const char *stats_filename = "./img-stats_v3.csv";
+    const char *stats_bin_filename = "./img-stats_v3.bin";
+    const char *png_filename_format = "./img%03d_v3.png";
+    const char *stream_filename = "./img-frames_v3.dmfs";
 
     // Nettoyer les fichiers
     remove(stats_filename);
+    remove(stats_bin_filename);
+    if (save_img == 2)
+        remove(stream_filename);
     char filename[256];
-    if (save_img) {
+    if (save_img == 1) {
         for (int i = 0; i < nb_steps; ++i) {
             snprintf(filename, 256, png_filename_format, i);
             remove(filename);
         }
     }
 
+    // Le thread i est épinglé sur le CPU i de DM_CPUS (DM_PIN=0 pour le laisser libre)
+    struct Affinity affinity;
+    affinity_from_env(&affinity, DEFAULT_THREADS, argc == 6 ? argv[5] : NULL);
+    int num_threads = affinity.n_workers;
+    if (num_threads < 1) {
+        fprintf(stderr, "nombre de threads invalide\n");
+        exit(1);
+    }
+    struct ThreadPool pool;
+    thread_pool_init(&pool, num_threads, &affinity);
+
+    // Pages placées par le premier thread qui les écrit (voir alloc_img_on_node)
     struct Image *img1 = alloc_img(width, height);
     struct Image *img2 = alloc_img(width, height);
     struct ImageStats stats;
 
+    enum StatsFormat stats_format = stats_format_from_env();
+    struct StatsSink *stats_sink = stats_sink_open(stats_format == STATS_BIN ? stats_bin_filename : stats_filename, stats_format,
+                                                   env_int("DM_STATS_FLUSH_RECORDS", 256), env_int("DM_STATS_FLUSH_MS", 1000));
+    struct FrameStream *stream = NULL;
+    if (save_img == 2)
+        stream = frame_stream_open(stream_filename, width, height, env_int("DM_KEYFRAME_INTERVAL", 30));
+
+    struct StepArgs args = {
+        .bodies = bodies,
+        .dt = dt,
+        .img1 = img1,
+        .img2 = img2,
+    };
+    pthread_mutex_init(&args.histogram_mutex, NULL);
+
     struct timespec t0, t1;
     if (clock_gettime(CLOCK_BOOTTIME, &t0) == -1) {
         perror("clock_gettime");
         exit(1);
     }
-
-    pthread_t threads[NUM_THREADS];
-    struct ThreadArgs thread_args[NUM_THREADS];
+    struct LiveProgress progress = { -1, 0, stats_sink };
+    live_metrics_start_from_env(nb_steps, live_sample_progress, &progress);
 
     for (int current_step = 0; current_step < nb_steps; ++current_step) {
-        for (int i = 0; i < NUM_THREADS; ++i) {
-            thread_args[i] = (struct ThreadArgs){
-                .bodies = bodies,
-                .n = N_BODIES,
-                .dt = 1.0,
-                .img1 = img1,
-                .img2 = img2,
-                .stats = &stats,
-                .current_step = current_step,
-                .save_img = save_img,
-                .png_filename_format = png_filename_format,
-                .stats_filename = stats_filename
-            };
-            pthread_create(&threads[i], NULL, thread_function, &thread_args[i]);
+        // Simuler les corps célestes : toutes les vitesses, puis les positions,
+        // DM_SUBSTEPS fois (la lecture du cache est comptée par traj_cache_read).
+        // Les pas par blocs ne recalculent que quelques corps à chaque instant :
+        // trop peu pour les répartir, ils restent sur le thread principal.
+        if (traj == NULL || !traj_cache_read(traj, current_step, bodies)) {
+            stage_begin(NBODIES_SIMULATION);
+            for (int s = 0; s < substeps; s++) {
+                if (integrator == INTEGRATOR_BLOCK) {
+                    simulate_block_step(bodies, N_BODIES, dt);
+                    continue;
+                }
+                parallel_for(&pool, 0, N_BODIES, GRAIN_BODIES, velocities_range, &args);
+                move_n_bodies(bodies, dt, 0, N_BODIES);
+            }
+            stage_end();
+            if (traj != NULL)
+                traj_cache_append(traj, current_step, bodies);
         }
 
-        for (int i = 0; i < NUM_THREADS; ++i) {
-            pthread_join(threads[i], NULL);
-        }
+        // Générer l'image à partir des corps
+        stage_begin(IMAGE_GENERATION);
+        parallel_for(&pool, 0, height, GRAIN_ROWS, generate_range, &args);
+        stage_end();
+
+        // Appliquer le flou gaussien
+        stage_begin(IMAGE_GAUSSIAN_BLUR);
+        parallel_for(&pool, 0, height, GRAIN_ROWS, blur_range, &args);
+        stage_end();
+
+        // Sauvegarder l'image si nécessaire (temps compté par la fonction)
+        if (save_img == 1)
+            save_img_as_png(img2, png_filename_format, current_step);
+        else if (save_img == 2)
+            frame_stream_write(stream, img2, current_step);
+
+        // Convertir en niveaux de gris
+        stage_begin(IMAGE_GRAYSCALE);
+        parallel_for(&pool, 0, height, GRAIN_ROWS, grayscale_range, &args);
+        stage_end();
+
+        // Calculer les statistiques de l'image
+        stage_begin(IMAGE_STATS);
+        memset(args.histogram, 0, sizeof(args.histogram));
+        parallel_for(&pool, 0, height, GRAIN_ROWS, histogram_range, &args);
+        image_statistics_from_histogram(args.histogram, width * height, &stats);
+        stage_end();
+
+        // Sauvegarder les statistiques
+        stats_sink_push(stats_sink, &stats, current_step);
+        atomic_store_explicit(&progress.steps_done, current_step + 1, memory_order_relaxed);
     }
 
+    live_metrics_stop();
+    if (stream != NULL)
+        frame_stream_close(stream);
+    stats_sink_close(stats_sink);
+    if (traj != NULL)
+        traj_cache_close(traj);
+
     if (clock_gettime(CLOCK_BOOTTIME, &t1) == -1) {
         perror("clock_gettime");
         exit(1);
@@ -142,9 +231,12 @@ int main(int argc, char *argv[]) {
     int64_t total_ns = ns_diff(&t0, &t1);
     printf("ok\n");
     print_elapsed_time_stats(total_ns);
+    trace_close();
 
+    thread_pool_destroy(&pool);
+    pthread_mutex_destroy(&args.histogram_mutex);
     free_img(img1);
     free_img(img2);
 
     return 0;
-}
\ No newline at end of file
+}
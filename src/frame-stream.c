@@ -0,0 +1,480 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "frame-stream.h"
+#include "metrics.h"
+
+#define RECORD_HEADER_SIZE 16
+
+struct Rect {
+  int x0;
+  int x1;
+  int y0;
+  int y1;
+};
+
+static void put_u16(uint8_t *p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+  p[0] = v & 0xff;
+  p[1] = (v >> 8) & 0xff;
+  p[2] = (v >> 16) & 0xff;
+  p[3] = v >> 24;
+}
+
+static uint16_t get_u16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint8_t * reserve(struct FrameStream *fs, size_t n) {
+  if (fs->buf_size + n > fs->buf_cap) {
+    while (fs->buf_size + n > fs->buf_cap)
+      fs->buf_cap *= 2;
+    fs->buf = realloc(fs->buf, fs->buf_cap);
+    if (fs->buf == NULL) {
+      perror("cannot grow frame stream buffer");
+      exit(1);
+    }
+  }
+  uint8_t *p = fs->buf + fs->buf_size;
+  fs->buf_size += n;
+  return p;
+}
+
+#define RLE_MAX_RUN 0x7fff
+
+static void put_run(struct FrameStream *fs, int count, const uint8_t *px) {
+  uint8_t *out;
+  if (count < 0x80) {
+    out = reserve(fs, 4);
+    *out++ = count;
+  } else {
+    out = reserve(fs, 5);
+    *out++ = 0x80 | (count >> 8);
+    *out++ = count & 0xff;
+  }
+  memcpy(out, px, 3);
+}
+
+// Appends the run-length encoding of the pixels of `r` (row-major), XORed
+// with those of `prev` unless it is NULL, and returns the number of bytes
+// written. Runs shorter than 128 pixels take one count byte, longer ones two
+// (high bit set).
+static size_t rle_encode(struct FrameStream *fs, const struct Image *img, const struct Image *prev, const struct Rect *r) {
+  size_t start = fs->buf_size;
+  uint8_t run[3];
+  int count = 0;
+
+  for (int y = r->y0; y < r->y1; y++) {
+    size_t idx = 3 * ((size_t)y * img->width + r->x0);
+    for (int x = r->x0; x < r->x1; x++, idx += 3) {
+      uint8_t px[3];
+      memcpy(px, &img->data[idx], 3);
+      if (prev != NULL) {
+        px[0] ^= prev->data[idx];
+        px[1] ^= prev->data[idx + 1];
+        px[2] ^= prev->data[idx + 2];
+      }
+      if (count > 0 && count < RLE_MAX_RUN && memcmp(px, run, 3) == 0) {
+        count++;
+        continue;
+      }
+      if (count > 0)
+        put_run(fs, count, run);
+      memcpy(run, px, 3);
+      count = 1;
+    }
+  }
+  if (count > 0)
+    put_run(fs, count, run);
+  return fs->buf_size - start;
+}
+
+// With `xor`, the runs are XORed into the pixels already in `img`.
+static bool rle_decode(const uint8_t *in, size_t size, struct Image *img, const struct Rect *r, bool xor) {
+  int x = r->x0;
+  int y = r->y0;
+  size_t i = 0;
+  while (i < size) {
+    int count = in[i++];
+    if (count & 0x80) {
+      if (i >= size)
+        return false;
+      count = ((count & 0x7f) << 8) | in[i++];
+    }
+    if (i + 3 > size)
+      return false;
+    const uint8_t *px = &in[i];
+    i += 3;
+    for (int k = 0; k < count; k++) {
+      if (y >= r->y1)
+        return false;
+      uint8_t *out = &img->data[3 * (y * img->width + x)];
+      if (xor) {
+        out[0] ^= px[0];
+        out[1] ^= px[1];
+        out[2] ^= px[2];
+      } else {
+        memcpy(out, px, 3);
+      }
+      if (++x == r->x1) {
+        x = r->x0;
+        y++;
+      }
+    }
+  }
+  return y == r->y1;
+}
+
+static void emit_rect(struct FrameStream *fs, const struct Image *img, const struct Rect *tiles, uint32_t *rect_count) {
+  struct Rect r = {
+    tiles->x0 * FRAME_STREAM_TILE
+  , tiles->x1 * FRAME_STREAM_TILE
+  , tiles->y0 * FRAME_STREAM_TILE
+  , tiles->y1 * FRAME_STREAM_TILE
+  };
+  if (r.x1 > img->width) r.x1 = img->width;
+  if (r.y1 > img->height) r.y1 = img->height;
+
+  size_t header = fs->buf_size;
+  reserve(fs, 12);
+  size_t rle_size = rle_encode(fs, img, fs->prev, &r);
+  uint8_t *p = fs->buf + header;
+  put_u16(p + 0, r.x0);
+  put_u16(p + 2, r.y0);
+  put_u16(p + 4, r.x1 - r.x0);
+  put_u16(p + 6, r.y1 - r.y0);
+  put_u32(p + 8, rle_size);
+  (*rect_count)++;
+}
+
+// Compares `img` against the previous frame tile by tile. Horizontal runs of
+// dirty tiles form spans, and a span identical to one of the tile row above
+// extends that rectangle downwards instead of opening a new one.
+static void encode_delta(struct FrameStream *fs, const struct Image *img) {
+  const int tiles_x = (img->width + FRAME_STREAM_TILE - 1) / FRAME_STREAM_TILE;
+  const int tiles_y = (img->height + FRAME_STREAM_TILE - 1) / FRAME_STREAM_TILE;
+  bool dirty[tiles_x];
+  struct Rect open[tiles_x];
+  struct Rect next[tiles_x];
+  int n_open = 0;
+  uint32_t rect_count = 0;
+
+  reserve(fs, 4);
+
+  for (int ty = 0; ty < tiles_y; ty++) {
+    memset(dirty, 0, sizeof(dirty));
+    int y_end = (ty + 1) * FRAME_STREAM_TILE;
+    if (y_end > img->height) y_end = img->height;
+    for (int y = ty * FRAME_STREAM_TILE; y < y_end; y++) {
+      for (int tx = 0; tx < tiles_x; tx++) {
+        if (dirty[tx])
+          continue;
+        int x0 = tx * FRAME_STREAM_TILE;
+        int w = img->width - x0 < FRAME_STREAM_TILE ? img->width - x0 : FRAME_STREAM_TILE;
+        size_t idx = 3 * ((size_t)y * img->width + x0);
+        dirty[tx] = memcmp(&img->data[idx], &fs->prev->data[idx], 3 * w) != 0;
+      }
+    }
+
+    int n_next = 0;
+    for (int tx = 0; tx < tiles_x; tx++) {
+      if (!dirty[tx])
+        continue;
+      int tx0 = tx;
+      while (tx < tiles_x && dirty[tx])
+        tx++;
+      struct Rect span = { tx0, tx, ty, ty + 1 };
+      for (int i = 0; i < n_open; i++) {
+        if (open[i].x0 == span.x0 && open[i].x1 == span.x1) {
+          span.y0 = open[i].y0;
+          open[i].x1 = open[i].x0; // consumed
+          break;
+        }
+      }
+      next[n_next++] = span;
+    }
+
+    for (int i = 0; i < n_open; i++) {
+      if (open[i].x1 != open[i].x0)
+        emit_rect(fs, img, &open[i], &rect_count);
+    }
+    memcpy(open, next, n_next * sizeof(struct Rect));
+    n_open = n_next;
+  }
+
+  for (int i = 0; i < n_open; i++)
+    emit_rect(fs, img, &open[i], &rect_count);
+
+  put_u32(fs->buf, rect_count);
+}
+
+static struct FrameStream * new_stream(FILE *fp, int width, int height, int keyframe_interval) {
+  struct FrameStream *fs = malloc(sizeof(struct FrameStream));
+  if (fs == NULL) {
+    perror("cannot allocate frame stream");
+    exit(1);
+  }
+
+  fs->fp = fp;
+  fs->width = width;
+  fs->height = height;
+  fs->keyframe_interval = keyframe_interval > 0 ? keyframe_interval : 1;
+  fs->frames_written = 0;
+  fs->prev = alloc_img(width, height);
+  fs->buf_cap = 4096;
+  fs->buf_size = 0;
+  fs->buf = malloc(fs->buf_cap);
+  fs->zbuf_cap = compressBound(fs->buf_cap);
+  fs->zbuf = malloc(fs->zbuf_cap);
+  if (fs->buf == NULL || fs->zbuf == NULL) {
+    perror("cannot allocate frame stream buffer");
+    exit(1);
+  }
+  return fs;
+}
+
+struct FrameStream * frame_stream_open(const char *filename, int width, int height, int keyframe_interval) {
+  FILE *fp = fopen(filename, "wb");
+  if (fp == NULL) {
+    perror("cannot open frame stream");
+    exit(1);
+  }
+  struct FrameStream *fs = new_stream(fp, width, height, keyframe_interval);
+
+  uint8_t header[20];
+  memcpy(header, FRAME_STREAM_MAGIC, 4);
+  put_u32(header + 4, FRAME_STREAM_VERSION);
+  put_u32(header + 8, width);
+  put_u32(header + 12, height);
+  put_u32(header + 16, fs->keyframe_interval);
+  if (fwrite(header, sizeof(header), 1, fs->fp) != 1) {
+    perror("cannot write frame stream header");
+    exit(1);
+  }
+  return fs;
+}
+
+// Length of the records of the steps before `first_step`, header included.
+// A record cut short by an interrupted run is dropped.
+static long kept_length(FILE *fp, int first_step) {
+  long kept = ftell(fp);
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  uint8_t rec[RECORD_HEADER_SIZE];
+  for (;;) {
+    fseek(fp, kept, SEEK_SET);
+    if (fread(rec, sizeof(rec), 1, fp) != 1 || (int)get_u32(rec) >= first_step)
+      break;
+    long end = kept + RECORD_HEADER_SIZE + get_u32(rec + 12);
+    if (end > size)
+      break;
+    kept = end;
+  }
+  return kept;
+}
+
+// Keeps the frames of the steps before `first_step` already in `filename`,
+// e.g. when resuming a run from a checkpoint. The first frame written is a
+// keyframe, so the kept part and the new one decode independently.
+struct FrameStream * frame_stream_append(const char *filename, int width, int height, int keyframe_interval, int first_step) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL)
+    return frame_stream_open(filename, width, height, keyframe_interval);
+
+  uint8_t header[20];
+  if (fread(header, sizeof(header), 1, fp) != 1
+      || memcmp(header, FRAME_STREAM_MAGIC, 4) != 0
+      || get_u32(header + 4) != FRAME_STREAM_VERSION
+      || (int)get_u32(header + 8) != width || (int)get_u32(header + 12) != height) {
+    fprintf(stderr, "'%s' is not a %dx%d frame stream\n", filename, width, height);
+    exit(1);
+  }
+  keyframe_interval = get_u32(header + 16);
+  long kept = kept_length(fp, first_step);
+  fclose(fp);
+  if (truncate(filename, kept) == -1) {
+    perror("cannot truncate frame stream");
+    exit(1);
+  }
+
+  fp = fopen(filename, "ab");
+  if (fp == NULL) {
+    perror("cannot open frame stream");
+    exit(1);
+  }
+  return new_stream(fp, width, height, keyframe_interval);
+}
+
+void frame_stream_write(struct FrameStream *fs, const struct Image *img, int current_step) {
+  METRICS_SCOPE(IMAGE_SAVE_FS);
+
+  enum FrameKind kind = (fs->frames_written % fs->keyframe_interval == 0) ? FRAME_KEY : FRAME_DELTA;
+  struct Rect whole = { 0, img->width, 0, img->height };
+
+  fs->buf_size = 0;
+  if (kind == FRAME_KEY)
+    rle_encode(fs, img, NULL, &whole);
+  else
+    encode_delta(fs, img);
+
+  uLongf payload_size = compressBound(fs->buf_size);
+  if (payload_size > fs->zbuf_cap) {
+    fs->zbuf_cap = payload_size;
+    fs->zbuf = realloc(fs->zbuf, fs->zbuf_cap);
+    if (fs->zbuf == NULL) {
+      perror("cannot grow frame stream buffer");
+      exit(1);
+    }
+  }
+  if (compress2(fs->zbuf, &payload_size, fs->buf, fs->buf_size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    fprintf(stderr, "cannot deflate frame stream record\n");
+    exit(1);
+  }
+
+  uint8_t header[RECORD_HEADER_SIZE] = {0};
+  put_u32(header, current_step);
+  header[4] = kind;
+  put_u32(header + 8, fs->buf_size);
+  put_u32(header + 12, payload_size);
+  if (fwrite(header, sizeof(header), 1, fs->fp) != 1
+      || fwrite(fs->zbuf, 1, payload_size, fs->fp) != payload_size) {
+    perror("cannot write frame stream record");
+    exit(1);
+  }
+
+  memcpy(fs->prev->data, img->data, 3 * img->width * img->height);
+  fs->frames_written++;
+}
+
+void frame_stream_close(struct FrameStream *fs) {
+  fclose(fs->fp);
+  free_img(fs->prev);
+  free(fs->buf);
+  free(fs->zbuf);
+  free(fs);
+}
+
+static bool decode_record(const uint8_t *payload, size_t size, enum FrameKind kind, struct Image *img) {
+  if (kind == FRAME_KEY) {
+    struct Rect whole = { 0, img->width, 0, img->height };
+    return rle_decode(payload, size, img, &whole, false);
+  }
+
+  if (size < 4)
+    return false;
+  uint32_t rect_count = get_u32(payload);
+  size_t pos = 4;
+  for (uint32_t i = 0; i < rect_count; i++) {
+    if (pos + 12 > size)
+      return false;
+    const uint8_t *p = payload + pos;
+    struct Rect r;
+    r.x0 = get_u16(p + 0);
+    r.y0 = get_u16(p + 2);
+    r.x1 = r.x0 + get_u16(p + 4);
+    r.y1 = r.y0 + get_u16(p + 6);
+    uint32_t rle_size = get_u32(p + 8);
+    pos += 12;
+    if (r.x1 > img->width || r.y1 > img->height || pos + rle_size > size)
+      return false;
+    if (!rle_decode(payload + pos, rle_size, img, &r, true))
+      return false;
+    pos += rle_size;
+  }
+  return true;
+}
+
+// Locates the last keyframe at or before `step`, then replays the records
+// from there up to `step`.
+struct Image * frame_stream_decode(const char *filename, int step) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    perror("cannot open frame stream");
+    return NULL;
+  }
+
+  uint8_t header[20];
+  if (fread(header, sizeof(header), 1, fp) != 1
+      || memcmp(header, FRAME_STREAM_MAGIC, 4) != 0
+      || get_u32(header + 4) != FRAME_STREAM_VERSION) {
+    fprintf(stderr, "'%s' is not a frame stream\n", filename);
+    fclose(fp);
+    return NULL;
+  }
+  int width = get_u32(header + 8);
+  int height = get_u32(header + 12);
+
+  long key_offset = -1;
+  bool found = false;
+  uint8_t rec[RECORD_HEADER_SIZE];
+  for (;;) {
+    long offset = ftell(fp);
+    if (fread(rec, sizeof(rec), 1, fp) != 1)
+      break;
+    int rec_step = get_u32(rec);
+    if (rec[4] == FRAME_KEY && rec_step <= step)
+      key_offset = offset;
+    if (rec_step == step) {
+      found = true;
+      break;
+    }
+    if (fseek(fp, get_u32(rec + 12), SEEK_CUR) != 0)
+      break;
+  }
+
+  if (!found || key_offset < 0) {
+    fprintf(stderr, "step %d not found in '%s'\n", step, filename);
+    fclose(fp);
+    return NULL;
+  }
+
+  struct Image *img = alloc_img(width, height);
+  uint8_t *payload = NULL;
+  uint8_t *body = NULL;
+  fseek(fp, key_offset, SEEK_SET);
+  for (;;) {
+    if (fread(rec, sizeof(rec), 1, fp) != 1)
+      goto corrupted;
+    uLongf body_size = get_u32(rec + 8);
+    size_t size = get_u32(rec + 12);
+    payload = realloc(payload, size > 0 ? size : 1);
+    if (payload == NULL || fread(payload, 1, size, fp) != size)
+      goto corrupted;
+    size_t expected = body_size;
+    body = realloc(body, body_size > 0 ? body_size : 1);
+    if (body == NULL || uncompress(body, &body_size, payload, size) != Z_OK || body_size != expected)
+      goto corrupted;
+    if (!decode_record(body, body_size, rec[4], img))
+      goto corrupted;
+    if ((int)get_u32(rec) == step)
+      break;
+  }
+
+  free(payload);
+  free(body);
+  fclose(fp);
+  return img;
+
+corrupted:
+  fprintf(stderr, "corrupted frame stream '%s'\n", filename);
+  free(payload);
+  free(body);
+  free_img(img);
+  fclose(fp);
+  return NULL;
+}
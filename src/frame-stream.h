@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "tasks.h"
+
+// A frame stream stores the rendered frames of a run in a single file:
+// a full keyframe every `keyframe_interval` frames, and in between only
+// the rectangles that changed since the previous frame, XORed with it so that
+// the pixels left unchanged inside a rectangle become runs of zeros. Pixels
+// are run-length encoded as (count, r, g, b) runs, the count taking one byte
+// below 128 and two bytes (high bit set) up to 32767, and the body of each
+// record is then deflated with zlib.
+//
+// File layout (little endian):
+//   header : "DMFS" u32 version, u32 width, u32 height, u32 keyframe_interval
+//   record : u32 step, u8 kind, u8 pad[3], u32 body_size, u32 payload_size,
+//            payload = deflate(body)
+//   key    : rle(whole frame)
+//   delta  : u32 rect_count, { u16 x, u16 y, u16 w, u16 h, u32 rle_size, rle(frame ^ previous) }*
+
+#define FRAME_STREAM_MAGIC "DMFS"
+#define FRAME_STREAM_VERSION 2
+#define FRAME_STREAM_TILE 16
+
+enum FrameKind {
+  FRAME_KEY = 0
+, FRAME_DELTA = 1
+};
+
+struct FrameStream {
+  FILE *fp;
+  int width;
+  int height;
+  int keyframe_interval;
+  int frames_written;
+  struct Image *prev;
+  uint8_t *buf;
+  size_t buf_size;
+  size_t buf_cap;
+  uint8_t *zbuf;
+  size_t zbuf_cap;
+};
+
+// Functions related to writing a stream.
+struct FrameStream * frame_stream_open(const char *filename, int width, int height, int keyframe_interval);
+struct FrameStream * frame_stream_append(const char *filename, int width, int height, int keyframe_interval, int first_step);
+void frame_stream_write(struct FrameStream *fs, const struct Image *img, int current_step);
+void frame_stream_close(struct FrameStream *fs);
+
+// Functions related to reading a stream.
+struct Image * frame_stream_decode(const char *filename, int step);
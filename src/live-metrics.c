@@ -0,0 +1,191 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+
+#include "live-metrics.h"
+#include "metrics.h"
+#include "tasks.h"
+
+struct LiveMetrics {
+  const char *filename;
+  char tmp_filename[4096];
+  int64_t interval_ns;
+  int nb_steps;
+  live_sample_fn sample;
+  void *ctx;
+
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;    // signalled by live_metrics_stop
+  bool stop;
+
+  struct timespec start;
+  // Previous write, for the per-second rates.
+  struct timespec last;
+  int64_t last_steps;
+  int64_t last_calls[STEP_MAX];
+};
+
+static struct LiveMetrics live;
+static bool live_running = false;
+
+static void write_gauge(FILE *fp, const char *name, const char *type, const char *help, double value) {
+  fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n%s %.9g\n", name, help, name, type, name, value);
+}
+
+static void write_metrics(FILE *fp, bool running) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double interval_s = ns_diff(&live.last, &now) / 1e9;
+
+  struct LiveSample s = { -1, -1, -1, -1 };
+  if (live.sample != NULL)
+    live.sample(live.ctx, &s);
+
+  write_gauge(fp, "dm_running", "gauge", "1 while the run is in progress.", running);
+  write_gauge(fp, "dm_elapsed_seconds", "gauge", "Time since the start of the run.", ns_diff(&live.start, &now) / 1e9);
+  write_gauge(fp, "dm_steps", "gauge", "Steps of the run.", live.nb_steps);
+  if (s.steps_done >= 0) {
+    write_gauge(fp, "dm_steps_completed_total", "counter", "Steps through every stage.", s.steps_done);
+    write_gauge(fp, "dm_steps_per_second", "gauge", "Steps completed per second since the previous write.",
+                interval_s > 0 ? (s.steps_done - live.last_steps) / interval_s : 0);
+    live.last_steps = s.steps_done;
+  }
+  if (s.in_flight >= 0)
+    write_gauge(fp, "dm_frames_in_flight", "gauge", "Frames simulated but not through every stage yet.", s.in_flight);
+  if (s.queue_depth >= 0)
+    write_gauge(fp, "dm_queue_depth", "gauge", "Tasks or frames waiting in queues.", s.queue_depth);
+  if (s.io_backlog >= 0)
+    write_gauge(fp, "dm_io_backlog", "gauge", "Writes waiting for the disk.", s.io_backlog);
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    write_gauge(fp, "dm_peak_rss_bytes", "gauge", "Peak resident set size of the process.", usage.ru_maxrss * 1024.0);
+
+#ifndef DM_NO_INSTRUMENT
+  struct StageReport report[STEP_MAX];
+  metrics_collect(report);
+  const char *names[] = { "dm_stage_calls_total", "dm_stage_busy_seconds_total", "dm_stage_calls_per_second" };
+  const char *types[] = { "counter", "counter", "gauge" };
+  const char *helps[] = {
+    "Calls of the stage.",
+    "Time spent in the stage, summed over threads.",
+    "Calls of the stage per second since the previous write.",
+  };
+  for (int m = 0; m < 3; m++) {
+    fprintf(fp, "# HELP %s %s\n# TYPE %s %s\n", names[m], helps[m], names[m], types[m]);
+    for (int step = STEP_MIN; step < STEP_MAX; step++) {
+      double value = m == 0 ? report[step].calls
+                   : m == 1 ? report[step].busy_ns / 1e9
+                   : interval_s > 0 ? (report[step].calls - live.last_calls[step]) / interval_s : 0;
+      fprintf(fp, "%s{stage=\"%s\"} %.9g\n", names[m], step_cstr[step], value);
+    }
+  }
+  for (int step = STEP_MIN; step < STEP_MAX; step++)
+    live.last_calls[step] = report[step].calls;
+#endif
+
+  live.last = now;
+}
+
+// The rename replaces the previous file at once.
+static void write_file(bool running) {
+  FILE *fp = fopen(live.tmp_filename, "w");
+  if (fp == NULL) {
+    perror("cannot open metrics file");
+    return;
+  }
+  write_metrics(fp, running);
+  if (fclose(fp) != 0) {
+    perror("cannot write metrics file");
+    return;
+  }
+  if (rename(live.tmp_filename, live.filename) == -1)
+    perror("cannot rename metrics file");
+}
+
+static void * live_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&live.mutex);
+  while (!live.stop) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += live.interval_ns / 1000000000LL;
+    deadline.tv_nsec += live.interval_ns % 1000000000LL;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (!live.stop && pthread_cond_timedwait(&live.wake, &live.mutex, &deadline) != ETIMEDOUT)
+      ;
+    if (live.stop)
+      break;
+    pthread_mutex_unlock(&live.mutex);
+    write_file(true);
+    pthread_mutex_lock(&live.mutex);
+  }
+  pthread_mutex_unlock(&live.mutex);
+  return NULL;
+}
+
+void live_sample_progress(void *ctx, struct LiveSample *sample) {
+  struct LiveProgress *progress = ctx;
+  int started = atomic_load_explicit(&progress->steps_started, memory_order_relaxed);
+  sample->steps_done = atomic_load_explicit(&progress->steps_done, memory_order_relaxed);
+  if (started >= 0)
+    sample->in_flight = started - sample->steps_done;
+  sample->io_backlog = stats_sink_pending(progress->stats_sink);
+}
+
+void live_metrics_start_from_env(int nb_steps, live_sample_fn sample, void *ctx) {
+  const char *filename = getenv("DM_METRICS_FILE");
+  if (filename == NULL || filename[0] == '\0')
+    return;
+
+  live.filename = filename;
+  snprintf(live.tmp_filename, sizeof(live.tmp_filename), "%s.tmp", filename);
+  int interval_ms = env_int("DM_METRICS_INTERVAL_MS", 1000);
+  live.interval_ns = (interval_ms > 0 ? interval_ms : 1000) * 1000000LL;
+  live.nb_steps = nb_steps;
+  live.sample = sample;
+  live.ctx = ctx;
+  live.stop = false;
+  clock_gettime(CLOCK_MONOTONIC, &live.start);
+  live.last = live.start;
+
+  pthread_mutex_init(&live.mutex, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&live.wake, &attr);
+  pthread_condattr_destroy(&attr);
+
+  write_file(true);
+  if (pthread_create(&live.thread, NULL, live_thread, NULL) != 0) {
+    fprintf(stderr, "cannot create metrics thread\n");
+    exit(1);
+  }
+  live_running = true;
+}
+
+void live_metrics_stop(void) {
+  if (!live_running)
+    return;
+  live_running = false;
+
+  pthread_mutex_lock(&live.mutex);
+  live.stop = true;
+  pthread_cond_signal(&live.wake);
+  pthread_mutex_unlock(&live.mutex);
+  pthread_join(live.thread, NULL);
+
+  write_file(false);
+  pthread_cond_destroy(&live.wake);
+  pthread_mutex_destroy(&live.mutex);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "stats-sink.h"
+
+// Live metrics, enabled with DM_METRICS_FILE=path: a background thread
+// rewrites `path` every DM_METRICS_INTERVAL_MS (1000 by default) in the
+// Prometheus text format, through a temporary file renamed over it so that a
+// reader never sees a partial file. It can be served by node_exporter's
+// textfile collector, or simply watched with `watch cat`.
+//
+// The file holds the progress of the run, the calls, busy time and calls per
+// second of each stage (when the build is instrumented), the peak RSS, and
+// whatever the variant's sampler knows among the gauges below.
+
+// Gauges a variant does not track are left at -1 and not written.
+struct LiveSample {
+  int64_t steps_done;
+  int64_t in_flight;      // frames between their simulation and their last stage
+  int64_t queue_depth;    // tasks or frames waiting in queues
+  int64_t io_backlog;     // writes waiting for the disk
+};
+
+// Called from the metrics thread: must only read shared state.
+typedef void (*live_sample_fn)(void *ctx, struct LiveSample *sample);
+
+// Sampler for variants that only count steps: steps_done and, unless it is
+// -1, steps_started (for in_flight), plus the records waiting in the stats
+// sink as the I/O backlog.
+struct LiveProgress {
+  atomic_int steps_started;
+  atomic_int steps_done;
+  struct StatsSink *stats_sink;
+};
+
+void live_sample_progress(void *ctx, struct LiveSample *sample);
+
+// Reads DM_METRICS_FILE and, when set, starts the metrics thread.
+void live_metrics_start_from_env(int nb_steps, live_sample_fn sample, void *ctx);
+// Writes the file one last time and stops the thread.
+void live_metrics_stop(void);
@@ -0,0 +1,372 @@
+#ifndef DM_NO_INSTRUMENT
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#include "metrics.h"
+#include "trace.h"
+
+#define CACHE_LINE 64
+
+// Shortest span used to convert ticks to ns.
+#define CALIBRATION_NS 10000000
+
+// Written by its thread only, with relaxed atomics so that metrics_collect can
+// read them while the thread is still running.
+// Busy intervals of one thread in one stage, in ticks, in the order they
+// ended. An interval that overlaps the previous one (a stage timed again
+// inside itself) is merged into it, so that they stay sorted and disjoint.
+#define INTERVAL_CHUNK 1024
+
+struct Interval {
+  _Atomic uint64_t begin;
+  _Atomic uint64_t end;
+};
+
+struct IntervalChunk {
+  struct Interval interval[INTERVAL_CHUNK];
+  struct IntervalChunk *_Atomic next;
+};
+
+struct StageSlot {
+  atomic_int_fast64_t busy;
+  atomic_int_fast64_t cpu_ns;
+  atomic_int_fast64_t calls;
+  atomic_int_fast64_t perf[PERF_COUNTERS];
+  atomic_int_fast64_t latency[LATENCY_BUCKETS];
+  struct IntervalChunk *first;
+  struct IntervalChunk *last;
+  atomic_int_fast64_t intervals;  // published with release, after the interval
+};
+
+struct ThreadSlot {
+  struct StageSlot stage[STEP_MAX];
+  struct ThreadSlot *next;
+};
+
+static pthread_once_t epoch_once = PTHREAD_ONCE_INIT;
+static bool use_tsc;
+static bool measure_cpu;
+static uint64_t epoch_ticks;
+static struct timespec epoch;
+
+static pthread_mutex_t slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct ThreadSlot *slots = NULL;
+static _Thread_local struct ThreadSlot *local_slot = NULL;
+
+static bool invariant_tsc(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (edx >> 8) & 1;
+#else
+  return false;
+#endif
+}
+
+static inline uint64_t ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (use_tsc)
+    return __rdtsc();
+#endif
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void init_epoch(void) {
+  use_tsc = invariant_tsc();
+  measure_cpu = env_int("DM_CPU_TIME", 0) != 0;
+  perf_init_from_env();
+  if (clock_gettime(CLOCK_MONOTONIC, &epoch) == -1) {
+    perror("clock_gettime");
+    exit(1);
+  }
+  epoch_ticks = ticks();
+}
+
+// Slots are never freed: the metrics of a thread outlive it.
+static struct ThreadSlot * new_thread_slot(void) {
+  pthread_once(&epoch_once, init_epoch);
+
+  struct ThreadSlot *slot = aligned_alloc(CACHE_LINE, (sizeof(struct ThreadSlot) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+  if (slot == NULL) {
+    perror("cannot allocate metrics slot");
+    exit(1);
+  }
+  memset(slot, 0, sizeof(struct ThreadSlot));
+
+  pthread_mutex_lock(&slots_mutex);
+  slot->next = slots;
+  slots = slot;
+  pthread_mutex_unlock(&slots_mutex);
+  local_slot = slot;
+  return slot;
+}
+
+static inline void relaxed_add(atomic_int_fast64_t *counter, int64_t value) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static int latency_bucket(uint64_t t) {
+  if (t < LATENCY_SUB_BUCKETS)
+    return t;
+  int exponent = 63 - __builtin_clzll(t);
+  int sub = (t >> (exponent - LATENCY_SUB_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+  return (exponent - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS + sub;
+}
+
+static uint64_t bucket_upper_bound(int bucket) {
+  if (bucket < LATENCY_SUB_BUCKETS)
+    return bucket;
+  int exponent = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BITS - 1;
+  uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+  return ((LATENCY_SUB_BUCKETS + sub + 1) << (exponent - LATENCY_SUB_BITS)) - 1;
+}
+
+static void add_interval(struct StageSlot *s, uint64_t begin, uint64_t end) {
+  int64_t n = atomic_load_explicit(&s->intervals, memory_order_relaxed);
+  if (n > 0) {
+    struct Interval *last = &s->last->interval[(n - 1) % INTERVAL_CHUNK];
+    if (begin < atomic_load_explicit(&last->end, memory_order_relaxed)) {
+      if (begin < atomic_load_explicit(&last->begin, memory_order_relaxed))
+        atomic_store_explicit(&last->begin, begin, memory_order_relaxed);
+      if (end > atomic_load_explicit(&last->end, memory_order_relaxed))
+        atomic_store_explicit(&last->end, end, memory_order_relaxed);
+      return;
+    }
+  }
+
+  if (n % INTERVAL_CHUNK == 0) {
+    struct IntervalChunk *chunk = calloc(1, sizeof(struct IntervalChunk));
+    if (chunk == NULL) {
+      perror("cannot allocate metrics intervals");
+      exit(1);
+    }
+    if (s->last == NULL)
+      s->first = chunk;
+    else
+      atomic_store_explicit(&s->last->next, chunk, memory_order_relaxed);
+    s->last = chunk;
+  }
+  struct Interval *interval = &s->last->interval[n % INTERVAL_CHUNK];
+  atomic_store_explicit(&interval->begin, begin, memory_order_relaxed);
+  atomic_store_explicit(&interval->end, end, memory_order_relaxed);
+  atomic_store_explicit(&s->intervals, n + 1, memory_order_release);
+}
+
+static void begin(struct MetricsTimer *timer, enum Step step, clockid_t cpu_clock) {
+  if (local_slot == NULL)
+    new_thread_slot();
+  timer->step = step;
+  timer->cpu_clock = cpu_clock;
+  timer->perf = perf_on && cpu_clock == CLOCK_THREAD_CPUTIME_ID && perf_read(&timer->perf0);
+  if (measure_cpu && clock_gettime(cpu_clock, &timer->cpu0) == -1) {
+    perror("clock_gettime");
+    exit(1);
+  }
+  if (trace_on)
+    timer->trace_begin = trace_now();
+  timer->begin = ticks();
+}
+
+void metrics_begin(struct MetricsTimer *timer, enum Step step) {
+  begin(timer, step, CLOCK_THREAD_CPUTIME_ID);
+}
+
+void metrics_begin_process(struct MetricsTimer *timer, enum Step step) {
+  begin(timer, step, CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void add_counters(struct StageSlot *s, const struct MetricsTimer *timer) {
+  struct PerfSample perf1;
+  if (!perf_read(&perf1))
+    return;
+  for (int c = 0; c < PERF_COUNTERS; c++)
+    relaxed_add(&s->perf[c], perf1.value[c] - timer->perf0.value[c]);
+}
+
+void metrics_begin_counters(struct MetricsTimer *timer, enum Step step) {
+  if (local_slot == NULL)
+    new_thread_slot();
+  timer->step = step;
+  timer->perf = perf_on && perf_read(&timer->perf0);
+}
+
+void metrics_end_counters(struct MetricsTimer *timer) {
+  if (timer->perf)
+    add_counters(&local_slot->stage[timer->step], timer);
+}
+
+void metrics_end(struct MetricsTimer *timer) {
+  uint64_t end = ticks();
+  if (trace_on)
+    trace_span(step_cstr[timer->step], timer->trace_begin, trace_now(), -1, -1, -1);
+
+  struct StageSlot *s = &local_slot->stage[timer->step];
+  relaxed_add(&s->busy, end - timer->begin);
+  relaxed_add(&s->calls, 1);
+  relaxed_add(&s->latency[latency_bucket(end - timer->begin)], 1);
+  add_interval(s, timer->begin, end);
+
+  if (timer->perf)
+    add_counters(s, timer);
+  if (measure_cpu) {
+    struct timespec cpu1;
+    if (clock_gettime(timer->cpu_clock, &cpu1) == -1) {
+      perror("clock_gettime");
+      exit(1);
+    }
+    relaxed_add(&s->cpu_ns, ns_diff(&timer->cpu0, &cpu1));
+  }
+}
+
+// Measured over the whole run, but at least CALIBRATION_NS.
+static double ns_per_tick(void) {
+  if (!use_tsc)
+    return 1.0;
+  struct timespec now;
+  uint64_t t;
+  do {
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+      perror("clock_gettime");
+      exit(1);
+    }
+    t = ticks();
+  } while (ns_diff(&epoch, &now) < CALIBRATION_NS);
+  return (double)ns_diff(&epoch, &now) / (t - epoch_ticks);
+}
+
+// Position in the intervals of one thread, up to those published when the
+// collection started.
+struct IntervalCursor {
+  struct IntervalChunk *chunk;
+  int64_t index;
+  int64_t count;
+};
+
+static const struct Interval * cursor_peek(const struct IntervalCursor *c) {
+  return c->index < c->count ? &c->chunk->interval[c->index % INTERVAL_CHUNK] : NULL;
+}
+
+static void cursor_next(struct IntervalCursor *c) {
+  c->index++;
+  if (c->index % INTERVAL_CHUNK == 0 && c->index < c->count)
+    c->chunk = atomic_load_explicit(&c->chunk->next, memory_order_relaxed);
+}
+
+// Length of the union of the intervals of every thread: the lists of the
+// threads are each sorted, so they are merged by taking the earliest head.
+static uint64_t wall_ticks(struct IntervalCursor *cursors, int n_cursors) {
+  uint64_t wall = 0;
+  uint64_t since = 0, until = 0;
+  bool open = false;
+  for (;;) {
+    struct IntervalCursor *earliest = NULL;
+    uint64_t begin = 0, end = 0;
+    for (int i = 0; i < n_cursors; i++) {
+      const struct Interval *head = cursor_peek(&cursors[i]);
+      if (head == NULL)
+        continue;
+      uint64_t head_begin = atomic_load_explicit(&head->begin, memory_order_relaxed);
+      if (earliest == NULL || head_begin < begin) {
+        earliest = &cursors[i];
+        begin = head_begin;
+        end = atomic_load_explicit(&head->end, memory_order_relaxed);
+      }
+    }
+    if (earliest == NULL)
+      break;
+    cursor_next(earliest);
+    if (!open || begin > until) {
+      if (open)
+        wall += until - since;
+      since = begin;
+      until = end;
+      open = true;
+    } else if (end > until) {
+      until = end;
+    }
+  }
+  if (open)
+    wall += until - since;
+  return wall;
+}
+
+void metrics_collect(struct StageReport report[STEP_MAX]) {
+  memset(report, 0, STEP_MAX * sizeof(struct StageReport));
+  pthread_once(&epoch_once, init_epoch);
+  double scale = ns_per_tick();
+
+  int64_t busy[STEP_MAX] = {0};
+  int64_t wall[STEP_MAX] = {0};
+  pthread_mutex_lock(&slots_mutex);
+  int n_slots = 0;
+  for (struct ThreadSlot *slot = slots; slot != NULL; slot = slot->next)
+    n_slots++;
+  struct IntervalCursor *cursors = malloc((n_slots > 0 ? n_slots : 1) * sizeof(struct IntervalCursor));
+  if (cursors == NULL) {
+    perror("cannot allocate metrics cursors");
+    exit(1);
+  }
+  for (int step = STEP_MIN; step < STEP_MAX; step++) {
+    int n = 0;
+    for (struct ThreadSlot *slot = slots; slot != NULL; slot = slot->next) {
+      struct StageSlot *s = &slot->stage[step];
+      cursors[n].index = 0;
+      cursors[n].count = atomic_load_explicit(&s->intervals, memory_order_acquire);
+      cursors[n].chunk = cursors[n].count > 0 ? s->first : NULL;
+      n++;
+    }
+    wall[step] = wall_ticks(cursors, n);
+  }
+  free(cursors);
+  for (struct ThreadSlot *slot = slots; slot != NULL; slot = slot->next) {
+    for (int step = STEP_MIN; step < STEP_MAX; step++) {
+      struct StageSlot *s = &slot->stage[step];
+      busy[step] += atomic_load_explicit(&s->busy, memory_order_relaxed);
+      report[step].cpu_ns += atomic_load_explicit(&s->cpu_ns, memory_order_relaxed);
+      report[step].calls += atomic_load_explicit(&s->calls, memory_order_relaxed);
+      for (int c = 0; c < PERF_COUNTERS; c++)
+        report[step].perf[c] += atomic_load_explicit(&s->perf[c], memory_order_relaxed);
+      for (int b = 0; b < LATENCY_BUCKETS; b++)
+        report[step].latency[b] += atomic_load_explicit(&s->latency[b], memory_order_relaxed);
+    }
+  }
+  pthread_mutex_unlock(&slots_mutex);
+
+  for (int step = STEP_MIN; step < STEP_MAX; step++) {
+    report[step].wall_ns = wall[step] * scale;
+    report[step].busy_ns = busy[step] * scale;
+    report[step].ns_per_tick = scale;
+    report[step].has_cpu = measure_cpu;
+  }
+}
+
+int64_t metrics_percentile(const struct StageReport *report, double q) {
+  if (report->calls == 0)
+    return 0;
+  uint64_t rank = q * report->calls;
+  if (rank >= (uint64_t)report->calls)
+    rank = report->calls - 1;
+  uint64_t seen = 0;
+  int b = 0;
+  for (; b < LATENCY_BUCKETS - 1; b++) {
+    seen += report->latency[b];
+    if (seen > rank)
+      break;
+  }
+  return bucket_upper_bound(b) * report->ns_per_tick;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "perf.h"
+#include "tasks.h"
+
+// Per-stage metrics. Every thread records into its own slot, allocated the
+// first time it times something; slots are only merged by metrics_collect, so
+// that recording never writes to a cache line shared with another thread.
+//
+// For each stage:
+//   - wall_ns: time during which at least one thread was in the stage. Unlike
+//     the per-thread sum, it never exceeds the elapsed time of the run. Each
+//     thread logs its busy intervals (16 bytes per call, fewer when calls
+//     overlap), and metrics_collect merges the logs of all the threads.
+//   - busy_ns: wall time spent in the stage, summed over the threads.
+//   - cpu_ns: CPU time spent in the stage, summed over the threads, only
+//     measured with DM_CPU_TIME=1 (it costs a system call per timer).
+//   - calls, and a latency histogram of the calls;
+//   - with DM_PERF=1, hardware counters (see perf.h).
+// With DM_TRACE, each call is also recorded as a trace span (see trace.h).
+//
+// Timers read the TSC when it is invariant, CLOCK_MONOTONIC otherwise; ticks
+// are converted to ns when collected, against the time elapsed since the
+// first timer. Building with -DDM_NO_INSTRUMENT removes every timer.
+
+// Latency buckets: LATENCY_SUB_BUCKETS per power of two of ticks, so a
+// percentile is known to within 1 / LATENCY_SUB_BUCKETS of its value.
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+
+struct MetricsTimer {
+  enum Step step;
+  uint64_t begin;         // ticks
+  clockid_t cpu_clock;
+  struct timespec cpu0;
+  int64_t trace_begin;    // with DM_TRACE, each call is also a trace span
+  bool perf;              // perf0 was read
+  struct PerfSample perf0;
+};
+
+struct StageReport {
+  int64_t wall_ns;
+  int64_t busy_ns;
+  int64_t cpu_ns;
+  int64_t calls;
+  uint64_t latency[LATENCY_BUCKETS];
+  double ns_per_tick;
+  bool has_cpu;           // cpu_ns was measured
+  int64_t perf[PERF_COUNTERS];
+};
+
+#ifndef DM_NO_INSTRUMENT
+
+// Times one call of `step` made by the calling thread.
+void metrics_begin(struct MetricsTimer *timer, enum Step step);
+// Same, but counts the CPU time of the whole process: for a thread that hands
+// the work of the stage to other threads and waits for them.
+void metrics_begin_process(struct MetricsTimer *timer, enum Step step);
+void metrics_end(struct MetricsTimer *timer);
+// Hardware counters only, for threads that do part of a call timed by
+// another thread (metrics_begin_process does not read them).
+void metrics_begin_counters(struct MetricsTimer *timer, enum Step step);
+void metrics_end_counters(struct MetricsTimer *timer);
+
+// Times the rest of the enclosing block, early returns included.
+#define METRICS_SCOPE(step) \
+  struct MetricsTimer metrics_scope __attribute__((cleanup(metrics_end))); \
+  metrics_begin(&metrics_scope, step)
+#define METRICS_COUNTERS_SCOPE(step) \
+  struct MetricsTimer metrics_scope __attribute__((cleanup(metrics_end_counters))); \
+  metrics_begin_counters(&metrics_scope, step)
+
+void metrics_collect(struct StageReport report[STEP_MAX]);
+// Upper bound, in ns, of the bucket that holds the q-th quantile (0 <= q <= 1).
+int64_t metrics_percentile(const struct StageReport *report, double q);
+
+#else
+
+static inline void metrics_begin(struct MetricsTimer *timer, enum Step step) { (void)timer; (void)step; }
+static inline void metrics_begin_process(struct MetricsTimer *timer, enum Step step) { (void)timer; (void)step; }
+static inline void metrics_end(struct MetricsTimer *timer) { (void)timer; }
+#define METRICS_SCOPE(step) (void)(step)
+#define METRICS_COUNTERS_SCOPE(step) (void)(step)
+
+#endif
@@ -0,0 +1,97 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include "perf.h"
+#include "tasks.h"
+
+struct PerfThread {
+  bool opened;
+  bool ok;
+  int leader;
+  int n_open;
+  enum PerfCounter counter_of[PERF_COUNTERS];   // position in a group read
+};
+
+bool perf_on = false;
+static atomic_bool available[PERF_COUNTERS];
+static atomic_bool warned;
+static _Thread_local struct PerfThread local;
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+} events[PERF_COUNTERS] = {
+  [PERF_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  [PERF_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  [PERF_LLC_MISSES]    = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  [PERF_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+void perf_init_from_env(void) {
+  perf_on = env_int("DM_PERF", 0) != 0;
+  for (int c = 0; c < PERF_COUNTERS; c++)
+    atomic_init(&available[c], perf_on);
+}
+
+bool perf_counter_available(enum PerfCounter counter) {
+  return atomic_load(&available[counter]);
+}
+
+static int open_event(enum PerfCounter counter, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = events[counter].type;
+  attr.config = events[counter].config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void open_thread(void) {
+  local.opened = true;
+  local.leader = open_event(PERF_CYCLES, -1);
+  if (local.leader < 0) {
+    if (!atomic_exchange(&warned, true))
+      fprintf(stderr, "DM_PERF: cannot open hardware counters (%s), see /proc/sys/kernel/perf_event_paranoid\n",
+              strerror(errno));
+    for (int c = 0; c < PERF_COUNTERS; c++)
+      atomic_store(&available[c], false);
+    return;
+  }
+  local.counter_of[local.n_open++] = PERF_CYCLES;
+  for (int c = PERF_CYCLES + 1; c < PERF_COUNTERS; c++) {
+    if (open_event(c, local.leader) >= 0)
+      local.counter_of[local.n_open++] = c;
+    else
+      atomic_store(&available[c], false);
+  }
+  local.ok = true;
+}
+
+bool perf_read(struct PerfSample *sample) {
+  if (!perf_on)
+    return false;
+  if (!local.opened)
+    open_thread();
+  if (!local.ok)
+    return false;
+
+  // nr, time_enabled, time_running, value[nr]
+  uint64_t buf[3 + PERF_COUNTERS];
+  if (read(local.leader, buf, sizeof(buf)) < (ssize_t)((3 + local.n_open) * sizeof(uint64_t)))
+    return false;
+  double scale = buf[2] > 0 && buf[2] < buf[1] ? (double)buf[1] / buf[2] : 1.0;
+  memset(sample, 0, sizeof(struct PerfSample));
+  for (int i = 0; i < local.n_open; i++)
+    sample->value[local.counter_of[i]] = buf[3 + i] * scale;
+  return true;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Hardware counters of the calling thread (perf_event_open), enabled with
+// DM_PERF=1. Only user-space events are counted, which
+// kernel.perf_event_paranoid <= 2 allows. When the counters cannot be opened
+// (no PMU in a VM, paranoid set to 3, seccomp...), a warning is printed once
+// and every read fails; a counter the CPU does not have is left out alone.
+
+enum PerfCounter {
+  PERF_CYCLES
+, PERF_INSTRUCTIONS
+, PERF_LLC_MISSES
+, PERF_BRANCH_MISSES
+, PERF_COUNTERS
+};
+
+struct PerfSample {
+  uint64_t value[PERF_COUNTERS];
+};
+
+extern bool perf_on;
+
+void perf_init_from_env(void);
+bool perf_counter_available(enum PerfCounter counter);
+// Opens the counters of the calling thread on its first call. Values are
+// scaled when the kernel multiplexed the counters.
+bool perf_read(struct PerfSample *sample);
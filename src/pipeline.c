@@ -0,0 +1,307 @@
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+#include "trace.h"
+
+void pipeline_init(struct Pipeline *p, int window, void *ctx) {
+  memset(p, 0, sizeof(struct Pipeline));
+  p->window = window > 0 ? window : 1;
+  p->ctx = ctx;
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->progress, NULL);
+}
+
+int pipeline_add_stage(struct Pipeline *p, const char *name, pipeline_stage_fn run, int flags) {
+  if (p->n_stages == PIPELINE_MAX_STAGES) {
+    fprintf(stderr, "pipeline: too many stages\n");
+    exit(1);
+  }
+  struct PipelineStage *s = &p->stages[p->n_stages];
+  memset(s, 0, sizeof(struct PipelineStage));
+  s->name = name;
+  s->run = run;
+  s->flags = flags;
+  s->source_rank = -1;
+  s->sink_rank = -1;
+  return p->n_stages++;
+}
+
+// Edges must go from a stage to one declared after it, which keeps the graph
+// acyclic and makes the declaration order a topological order.
+void pipeline_add_edge(struct Pipeline *p, int from, int to, int capacity) {
+  if (from < 0 || to >= p->n_stages || from >= to) {
+    fprintf(stderr, "pipeline: invalid edge %d -> %d\n", from, to);
+    exit(1);
+  }
+  struct PipelineStage *src = &p->stages[from];
+  struct PipelineStage *dst = &p->stages[to];
+  if (src->n_out == PIPELINE_MAX_EDGES || dst->n_in == PIPELINE_MAX_EDGES) {
+    fprintf(stderr, "pipeline: too many edges on '%s' -> '%s'\n", src->name, dst->name);
+    exit(1);
+  }
+  if (capacity < 1) capacity = 1;
+  if (capacity > p->window) capacity = p->window;
+
+  src->out[src->n_out].to = to;
+  src->out[src->n_out].capacity = capacity;
+  src->out[src->n_out].queue = p->n_edges;
+  src->n_out++;
+  dst->in[dst->n_in] = from;
+  dst->in_queue[dst->n_in] = p->n_edges;
+  dst->n_in++;
+  p->n_edges++;
+}
+
+// Ranks of the stages without inputs or without outputs, once the graph is
+// complete.
+static void rank_ends(struct Pipeline *p) {
+  p->n_sources = 0;
+  p->n_sinks = 0;
+  for (int s = 0; s < p->n_stages; ++s) {
+    struct PipelineStage *stage = &p->stages[s];
+    stage->source_rank = stage->n_in == 0 ? p->n_sources++ : -1;
+    stage->sink_rank = stage->n_out == 0 ? p->n_sinks++ : -1;
+  }
+}
+
+int pipeline_waiting(struct Pipeline *p, int stage) {
+  const struct PipelineStage *s = &p->stages[stage];
+  if (s->n_in == 0)
+    return 0;
+  int ready = INT_MAX;
+  for (int i = 0; i < s->n_in; i++) {
+    int finished = atomic_load_explicit(&p->stages[s->in[i]].finished, memory_order_relaxed);
+    if (finished < ready)
+      ready = finished;
+  }
+  int waiting = ready - atomic_load_explicit(&s->started, memory_order_relaxed);
+  return waiting > 0 ? waiting : 0;
+}
+
+static void run_step(struct Pipeline *p, int stage, int step) {
+  struct PipelineStage *s = &p->stages[stage];
+  atomic_fetch_add_explicit(&s->started, 1, memory_order_relaxed);
+  s->run(p->ctx, step);
+  atomic_fetch_add_explicit(&s->finished, 1, memory_order_relaxed);
+}
+
+static bool is_done(const struct Pipeline *p, int stage, int step) {
+  return step < 0 || p->stages[stage].done[step % p->window] >= step;
+}
+
+// Must be called with the mutex held.
+static bool is_ready(const struct Pipeline *p, int stage, int step) {
+  const struct PipelineStage *s = &p->stages[stage];
+  if (step >= p->nb_steps || step >= p->oldest_step + p->window)
+    return false;
+  if ((s->flags & PIPELINE_SERIAL) && !is_done(p, stage, step - 1))
+    return false;
+  for (int i = 0; i < s->n_in; i++) {
+    if (!is_done(p, s->in[i], step))
+      return false;
+  }
+  for (int i = 0; i < s->n_out; i++) {
+    if (!is_done(p, s->out[i].to, step - s->out[i].capacity))
+      return false;
+  }
+  return true;
+}
+
+// Must be called with the mutex held.
+static void complete(struct Pipeline *p, int stage, int step) {
+  p->stages[stage].done[step % p->window] = step;
+  p->remaining[step % p->window]--;
+
+  while (p->oldest_step < p->nb_steps && p->remaining[p->oldest_step % p->window] == 0) {
+    p->remaining[p->oldest_step % p->window] = p->n_stages;
+    p->oldest_step++;
+  }
+  pthread_cond_broadcast(&p->progress);
+}
+
+static void run_sequential(struct Pipeline *p) {
+  for (int step = 0; step < p->nb_steps; ++step) {
+    for (int s = 0; s < p->n_stages; ++s)
+      run_step(p, s, step);
+  }
+}
+
+struct StageThreadArgs {
+  struct Pipeline *p;
+  int stage;
+};
+
+static struct SpscQueue * recycle_queue(struct Pipeline *p, int sink_rank, int source_rank) {
+  return &p->queues[p->n_edges + sink_rank * p->n_sources + source_rank];
+}
+
+// Every stage handles the steps in order, so each queue carries them in order.
+static void pop_step(struct SpscQueue *q, int expected) {
+  int step;
+  spsc_queue_pop(q, &step);
+  if (step != expected) {
+    fprintf(stderr, "pipeline: step %d received instead of %d\n", step, expected);
+    exit(1);
+  }
+}
+
+// Waits for its inputs and, for a source, for the slot of step - window to be
+// handed back by every sink.
+static void * stage_thread(void *arg) {
+  struct StageThreadArgs *args = arg;
+  struct Pipeline *p = args->p;
+  struct PipelineStage *s = &p->stages[args->stage];
+  trace_thread_name(s->name);
+
+  for (int step = 0; step < p->nb_steps; ++step) {
+    int64_t wait_begin = trace_on ? trace_now() : 0;
+    if (s->source_rank >= 0 && step >= p->window) {
+      for (int t = 0; t < p->n_sinks; ++t)
+        pop_step(recycle_queue(p, t, s->source_rank), step - p->window);
+    }
+    for (int i = 0; i < s->n_in; ++i)
+      pop_step(&p->queues[s->in_queue[i]], step);
+
+    int64_t begin = trace_on ? trace_now() : 0;
+    run_step(p, args->stage, step);
+    if (trace_on)
+      trace_span(s->name, begin, trace_now(), step, -1, begin - wait_begin);
+
+    for (int i = 0; i < s->n_out; ++i)
+      spsc_queue_push(&p->queues[s->out[i].queue], &step);
+    if (s->sink_rank >= 0) {
+      for (int r = 0; r < p->n_sources; ++r)
+        spsc_queue_push(recycle_queue(p, s->sink_rank, r), &step);
+    }
+  }
+  return NULL;
+}
+
+// Later stages are looked at first so that in-flight steps drain before new
+// ones are started.
+static void * pool_thread(void *arg) {
+  struct Pipeline *p = arg;
+  trace_thread_name("pipeline worker");
+
+  pthread_mutex_lock(&p->mutex);
+  while (p->oldest_step < p->nb_steps) {
+    int stage = -1;
+    for (int s = p->n_stages - 1; s >= 0; --s) {
+      if (is_ready(p, s, p->stages[s].next_step)) {
+        stage = s;
+        break;
+      }
+    }
+    if (stage < 0) {
+      pthread_cond_wait(&p->progress, &p->mutex);
+      continue;
+    }
+
+    int step = p->stages[stage].next_step++;
+    pthread_mutex_unlock(&p->mutex);
+    int64_t begin = trace_on ? trace_now() : 0;
+    run_step(p, stage, step);
+    if (trace_on)
+      trace_span(p->stages[stage].name, begin, trace_now(), step, -1, -1);
+    pthread_mutex_lock(&p->mutex);
+    complete(p, stage, step);
+  }
+  pthread_mutex_unlock(&p->mutex);
+  return NULL;
+}
+
+static void spawn_and_join(int n, void *(*fn)(void *), void *args, size_t args_size) {
+  pthread_t threads[n];
+  for (int i = 0; i < n; ++i) {
+    int err = pthread_create(&threads[i], NULL, fn, (char *)args + i * args_size);
+    if (err != 0) {
+      fprintf(stderr, "pipeline: pthread_create failed (%s)\n", strerror(err));
+      exit(1);
+    }
+  }
+  for (int i = 0; i < n; ++i)
+    pthread_join(threads[i], NULL);
+}
+
+void pipeline_run(struct Pipeline *p, int nb_steps, enum PipelineExecutor executor, int n_threads) {
+  rank_ends(p);
+  p->nb_steps = nb_steps;
+  p->oldest_step = 0;
+  p->remaining = malloc(p->window * sizeof(int));
+  for (int i = 0; i < p->window; ++i)
+    p->remaining[i] = p->n_stages;
+  for (int s = 0; s < p->n_stages; ++s) {
+    p->stages[s].next_step = 0;
+    atomic_store(&p->stages[s].started, 0);
+    atomic_store(&p->stages[s].finished, 0);
+    p->stages[s].done = malloc(p->window * sizeof(int));
+    for (int i = 0; i < p->window; ++i)
+      p->stages[s].done[i] = -1;
+  }
+
+  switch (executor) {
+    case PIPELINE_SEQUENTIAL:
+      run_sequential(p);
+      break;
+    case PIPELINE_STAGE_THREADS: {
+      int n_queues = p->n_edges + p->n_sinks * p->n_sources;
+      p->queues = malloc(n_queues * sizeof(struct SpscQueue));
+      if (p->queues == NULL) {
+        perror("pipeline: cannot allocate queues");
+        exit(1);
+      }
+      for (int s = 0; s < p->n_stages; ++s) {
+        for (int i = 0; i < p->stages[s].n_out; ++i)
+          spsc_queue_init(&p->queues[p->stages[s].out[i].queue], p->stages[s].out[i].capacity, sizeof(int));
+      }
+      for (int q = p->n_edges; q < n_queues; ++q)
+        spsc_queue_init(&p->queues[q], p->window, sizeof(int));
+
+      struct StageThreadArgs args[p->n_stages];
+      for (int s = 0; s < p->n_stages; ++s) {
+        args[s].p = p;
+        args[s].stage = s;
+      }
+      spawn_and_join(p->n_stages, stage_thread, args, sizeof(struct StageThreadArgs));
+
+      for (int q = 0; q < n_queues; ++q)
+        spsc_queue_destroy(&p->queues[q]);
+      free(p->queues);
+      p->queues = NULL;
+      break;
+    }
+    case PIPELINE_POOL:
+      spawn_and_join(n_threads > 0 ? n_threads : 1, pool_thread, p, 0);
+      break;
+  }
+
+  for (int s = 0; s < p->n_stages; ++s) {
+    free(p->stages[s].done);
+    p->stages[s].done = NULL;
+  }
+  free(p->remaining);
+  p->remaining = NULL;
+}
+
+void pipeline_destroy(struct Pipeline *p) {
+  pthread_mutex_destroy(&p->mutex);
+  pthread_cond_destroy(&p->progress);
+}
+
+enum PipelineExecutor pipeline_executor_from_env(void) {
+  const char *value = getenv("DM_EXECUTOR");
+  if (value == NULL || *value == '\0' || strcmp(value, "pool") == 0)
+    return PIPELINE_POOL;
+  if (strcmp(value, "seq") == 0)
+    return PIPELINE_SEQUENTIAL;
+  if (strcmp(value, "stages") == 0)
+    return PIPELINE_STAGE_THREADS;
+
+  fprintf(stderr, "invalid value for DM_EXECUTOR: '%s' (seq, stages or pool)\n", value);
+  exit(1);
+}
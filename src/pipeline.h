@@ -0,0 +1,100 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "spsc-queue.h"
+
+// A pipeline is a DAG of stages declared once and run for steps 0..n-1 by an
+// interchangeable executor. Stage `s` may run step `k` when:
+//   - every stage with an edge to `s` has finished step k;
+//   - for every edge s -> v of capacity c, v has finished step k - c, i.e. at
+//     most c results of `s` are buffered on that edge;
+//   - the stage is PIPELINE_SERIAL and has finished step k - 1 (state carried
+//     from one step to the next, or output that must stay in step order);
+//   - step k - window has gone through every stage, so that data indexed by
+//     `step % window` can be reused for step k.
+//
+// Stage functions receive the pipeline context and the step number; they are
+// expected to address their buffers with `step % window`.
+//
+// With PIPELINE_STAGE_THREADS, stages are linked by SPSC queues of step
+// numbers: one per edge, holding at most `capacity` steps (rounded up to a
+// power of two), and one from each sink back to each source, through which
+// the slot of step k - window is handed back for step k.
+//
+// Other executors can be written outside this file from the stages and edges
+// of the graph: dm-v2 runs them as tasks on its work-stealing pool, with one
+// context per scenario.
+
+#define PIPELINE_MAX_STAGES 16
+#define PIPELINE_MAX_EDGES 8
+
+enum PipelineFlags {
+  PIPELINE_PARALLEL = 0
+, PIPELINE_SERIAL = 1 << 0
+};
+
+enum PipelineExecutor {
+  PIPELINE_SEQUENTIAL  // steps one after the other in the calling thread
+, PIPELINE_STAGE_THREADS  // one thread per stage
+, PIPELINE_POOL  // any (stage, step) that is ready, on a fixed set of threads
+};
+
+typedef void (*pipeline_stage_fn)(void *ctx, int step);
+
+struct PipelineEdge {
+  int to;
+  int capacity;
+  int queue;  // index of its queue with PIPELINE_STAGE_THREADS
+};
+
+struct PipelineStage {
+  const char *name;
+  pipeline_stage_fn run;
+  int flags;
+  int n_in;
+  struct PipelineEdge out[PIPELINE_MAX_EDGES];
+  int n_out;
+  int in[PIPELINE_MAX_EDGES];
+  int in_queue[PIPELINE_MAX_EDGES];
+  int source_rank;  // among stages without inputs, -1 for the others
+  int sink_rank;  // among stages without outputs, -1 for the others
+
+  // Executor state.
+  int next_step;
+  int *done;  // done[step % window] == step once finished
+  atomic_int started;
+  atomic_int finished;
+};
+
+struct Pipeline {
+  struct PipelineStage stages[PIPELINE_MAX_STAGES];
+  int n_stages;
+  int n_edges;
+  int n_sources;
+  int n_sinks;
+  int window;
+  void *ctx;
+
+  // Executor state.
+  int nb_steps;
+  int oldest_step;  // oldest step not through every stage yet
+  int *remaining;  // remaining[step % window] : stages left for that step
+  pthread_mutex_t mutex;
+  pthread_cond_t progress;
+  struct SpscQueue *queues;  // PIPELINE_STAGE_THREADS: edges, then sink -> source
+};
+
+void pipeline_init(struct Pipeline *p, int window, void *ctx);
+int pipeline_add_stage(struct Pipeline *p, const char *name, pipeline_stage_fn run, int flags);
+void pipeline_add_edge(struct Pipeline *p, int from, int to, int capacity);
+void pipeline_run(struct Pipeline *p, int nb_steps, enum PipelineExecutor executor, int n_threads);
+void pipeline_destroy(struct Pipeline *p);
+
+// Steps finished by every predecessor of `stage` but not started by it yet,
+// with any executor. Approximate when read while the pipeline runs.
+int pipeline_waiting(struct Pipeline *p, int stage);
+
+enum PipelineExecutor pipeline_executor_from_env(void);
@@ -0,0 +1,65 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reorder.h"
+
+void reorder_init(struct ReorderBuffer *rb, int window, size_t elem_size, int first_step, reorder_release_fn release, void *ctx) {
+  rb->window = window > 0 ? window : 1;
+  rb->elem_size = elem_size;
+  rb->elems = malloc(rb->window * elem_size);
+  rb->steps = malloc(rb->window * sizeof(int));
+  if (rb->elems == NULL || rb->steps == NULL) {
+    perror("cannot allocate reorder buffer");
+    exit(1);
+  }
+  for (int i = 0; i < rb->window; i++)
+    rb->steps[i] = -1;
+  rb->next_step = first_step;
+  rb->releasing = false;
+  rb->release = release;
+  rb->ctx = ctx;
+  pthread_mutex_init(&rb->mutex, NULL);
+  pthread_cond_init(&rb->space, NULL);
+}
+
+void reorder_destroy(struct ReorderBuffer *rb) {
+  pthread_mutex_destroy(&rb->mutex);
+  pthread_cond_destroy(&rb->space);
+  free(rb->elems);
+  free(rb->steps);
+}
+
+void reorder_submit(struct ReorderBuffer *rb, int step, const void *elem) {
+  pthread_mutex_lock(&rb->mutex);
+  if (step < rb->next_step) {
+    fprintf(stderr, "reorder: step %d submitted twice or after its release\n", step);
+    exit(1);
+  }
+  while (step >= rb->next_step + rb->window)
+    pthread_cond_wait(&rb->space, &rb->mutex);
+
+  int slot = step % rb->window;
+  memcpy(rb->elems + slot * rb->elem_size, elem, rb->elem_size);
+  rb->steps[slot] = step;
+
+  if (rb->releasing) {
+    pthread_mutex_unlock(&rb->mutex);
+    return;
+  }
+
+  // The slot of next_step cannot be overwritten until next_step moves on, so
+  // it is safe to read it with the lock dropped.
+  rb->releasing = true;
+  while (rb->steps[rb->next_step % rb->window] == rb->next_step) {
+    int next = rb->next_step;
+    pthread_mutex_unlock(&rb->mutex);
+    rb->release(rb->ctx, rb->elems + (next % rb->window) * rb->elem_size, next);
+    pthread_mutex_lock(&rb->mutex);
+    rb->next_step++;
+    pthread_cond_broadcast(&rb->space);
+  }
+  rb->releasing = false;
+  pthread_mutex_unlock(&rb->mutex);
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Reorder buffer: results tagged with their step are submitted in any order
+// and handed to `release` strictly in step order, one at a time. At most
+// `window` steps past the next one to release are buffered; a submit further
+// ahead waits for room.
+//
+// The thread whose submit makes the next step available releases it, then
+// any following steps already buffered, with the lock dropped around each
+// call. Other submitters only copy their result in and return.
+
+typedef void (*reorder_release_fn)(void *ctx, const void *elem, int step);
+
+struct ReorderBuffer {
+  int window;
+  size_t elem_size;
+  unsigned char *elems;
+  int *steps;  // steps[step % window] == step once submitted
+  int next_step;
+  bool releasing;
+  reorder_release_fn release;
+  void *ctx;
+  pthread_mutex_t mutex;
+  pthread_cond_t space;
+};
+
+void reorder_init(struct ReorderBuffer *rb, int window, size_t elem_size, int first_step, reorder_release_fn release, void *ctx);
+void reorder_destroy(struct ReorderBuffer *rb);
+
+void reorder_submit(struct ReorderBuffer *rb, int step, const void *elem);
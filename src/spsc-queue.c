@@ -0,0 +1,122 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc-queue.h"
+
+void spsc_queue_init(struct SpscQueue *q, size_t capacity, size_t elem_size) {
+  size_t size = 2;
+  while (size < capacity)
+    size *= 2;
+
+  q->mask = size - 1;
+  q->elem_size = elem_size;
+  q->cells = malloc(size * elem_size);
+  if (q->cells == NULL) {
+    perror("cannot allocate spsc queue");
+    exit(1);
+  }
+
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  q->cached_head = 0;
+  q->cached_tail = 0;
+  atomic_init(&q->not_empty_seq, 0);
+  atomic_init(&q->consumer_waiting, 0);
+  atomic_init(&q->not_full_seq, 0);
+  atomic_init(&q->producer_waiting, 0);
+}
+
+void spsc_queue_destroy(struct SpscQueue *q) {
+  free(q->cells);
+  q->cells = NULL;
+}
+
+bool spsc_queue_try_push(struct SpscQueue *q, const void *elem) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  if (tail - q->cached_head > q->mask) {
+    q->cached_head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - q->cached_head > q->mask)
+      return false; // full
+  }
+
+  memcpy(q->cells + (tail & q->mask) * q->elem_size, elem, q->elem_size);
+  // seq_cst so that the store is ordered before reading the waiter flag (see
+  // task_queue_try_push).
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_seq_cst);
+
+  if (atomic_load_explicit(&q->consumer_waiting, memory_order_seq_cst)) {
+    atomic_fetch_add(&q->not_empty_seq, 1);
+    futex_wake(&q->not_empty_seq, 1);
+  }
+  return true;
+}
+
+bool spsc_queue_try_pop(struct SpscQueue *q, void *elem) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if (head == q->cached_tail) {
+    q->cached_tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == q->cached_tail)
+      return false; // empty
+  }
+
+  memcpy(elem, q->cells + (head & q->mask) * q->elem_size, q->elem_size);
+  atomic_store_explicit(&q->head, head + 1, memory_order_seq_cst);
+
+  if (atomic_load_explicit(&q->producer_waiting, memory_order_seq_cst)) {
+    atomic_fetch_add(&q->not_full_seq, 1);
+    futex_wake(&q->not_full_seq, 1);
+  }
+  return true;
+}
+
+void spsc_queue_push(struct SpscQueue *q, const void *elem) {
+  for (;;) {
+    if (spsc_queue_try_push(q, elem))
+      return;
+    for (int i = 0; i < spin_tries(); i++) {
+      cpu_relax();
+      if (spsc_queue_try_push(q, elem))
+        return;
+    }
+
+    atomic_store(&q->producer_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned int seq = atomic_load(&q->not_full_seq);
+    if (spsc_queue_try_push(q, elem)) {
+      atomic_store(&q->producer_waiting, 0);
+      return;
+    }
+    futex_wait(&q->not_full_seq, seq);
+    atomic_store(&q->producer_waiting, 0);
+  }
+}
+
+void spsc_queue_pop(struct SpscQueue *q, void *elem) {
+  for (;;) {
+    if (spsc_queue_try_pop(q, elem))
+      return;
+    for (int i = 0; i < spin_tries(); i++) {
+      cpu_relax();
+      if (spsc_queue_try_pop(q, elem))
+        return;
+    }
+
+    atomic_store(&q->consumer_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned int seq = atomic_load(&q->not_empty_seq);
+    if (spsc_queue_try_pop(q, elem)) {
+      atomic_store(&q->consumer_waiting, 0);
+      return;
+    }
+    futex_wait(&q->not_empty_seq, seq);
+    atomic_store(&q->consumer_waiting, 0);
+  }
+}
+
+size_t spsc_queue_size(struct SpscQueue *q) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  return tail > head ? tail - head : 0;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "task-queue.h"
+
+// Bounded lock-free single-producer/single-consumer ring. Each side owns its
+// index and keeps a cached copy of the other one, so the shared cache line is
+// only read when the ring looks full (producer) or empty (consumer).
+//
+// The blocking variants spin briefly, then park on a futex; a wake-up syscall
+// is only issued when the other side is actually parked.
+
+struct SpscQueue {
+  size_t mask;
+  size_t elem_size;
+  unsigned char *cells;
+
+  alignas(CACHE_LINE_SIZE) atomic_size_t head;  // next slot to read, written by the consumer
+  size_t cached_tail;
+  alignas(CACHE_LINE_SIZE) atomic_size_t tail;  // next slot to write, written by the producer
+  size_t cached_head;
+
+  alignas(CACHE_LINE_SIZE) atomic_uint not_empty_seq;
+  atomic_int consumer_waiting;
+  alignas(CACHE_LINE_SIZE) atomic_uint not_full_seq;
+  atomic_int producer_waiting;
+};
+
+// `capacity` is rounded up to a power of two.
+void spsc_queue_init(struct SpscQueue *q, size_t capacity, size_t elem_size);
+void spsc_queue_destroy(struct SpscQueue *q);
+
+bool spsc_queue_try_push(struct SpscQueue *q, const void *elem);
+bool spsc_queue_try_pop(struct SpscQueue *q, void *elem);
+void spsc_queue_push(struct SpscQueue *q, const void *elem);
+void spsc_queue_pop(struct SpscQueue *q, void *elem);
+// Approximate when read by a third thread.
+size_t spsc_queue_size(struct SpscQueue *q);
@@ -0,0 +1,284 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "stats-sink.h"
+#include "metrics.h"
+#include "trace.h"
+
+enum StatsFormat stats_format_from_env(void) {
+  const char *value = getenv("DM_STATS_FORMAT");
+  if (value == NULL || *value == '\0' || strcmp(value, "csv") == 0)
+    return STATS_CSV;
+  if (strcmp(value, "bin") == 0)
+    return STATS_BIN;
+
+  fprintf(stderr, "invalid value for DM_STATS_FORMAT: '%s' (csv or bin)\n", value);
+  exit(1);
+}
+
+size_t stats_block_size(uint32_t count) {
+  size_t size = sizeof(struct StatsBlockHeader) + count * (2 * sizeof(double) + sizeof(int32_t) + 3);
+  return (size + 7) & ~(size_t)7;
+}
+
+static void write_csv(struct StatsSink *sink) {
+  for (int i = 0; i < sink->count; i++) {
+    const struct StatsRecord *r = &sink->records[i];
+    fprintf(sink->fp, "%d,%d,%d,%d,%.2f,%.2f\n", r->step, r->stats.min, r->stats.max, r->stats.mode, r->stats.mean, r->stats.median);
+  }
+}
+
+static void write_bin(struct StatsSink *sink) {
+  uint32_t count = sink->count;
+  size_t size = stats_block_size(count);
+  uint8_t *block = calloc(1, size);
+  if (block == NULL) {
+    perror("cannot allocate stats block");
+    exit(1);
+  }
+
+  struct StatsBlockHeader *header = (struct StatsBlockHeader *)block;
+  memcpy(header->magic, STATS_BLOCK_MAGIC, 4);
+  header->count = count;
+
+  double *mean = (double *)(block + sizeof(struct StatsBlockHeader));
+  double *median = mean + count;
+  int32_t *step = (int32_t *)(median + count);
+  uint8_t *min = (uint8_t *)(step + count);
+  uint8_t *max = min + count;
+  uint8_t *mode = max + count;
+
+  for (uint32_t i = 0; i < count; i++) {
+    const struct StatsRecord *r = &sink->records[i];
+    mean[i] = r->stats.mean;
+    median[i] = r->stats.median;
+    step[i] = r->step;
+    min[i] = r->stats.min;
+    max[i] = r->stats.max;
+    mode[i] = r->stats.mode;
+  }
+
+  if (fwrite(block, size, 1, sink->fp) != 1) {
+    perror("cannot save stats to file");
+    exit(1);
+  }
+  free(block);
+}
+
+// Must be called with the sink mutex held.
+static void flush_locked(struct StatsSink *sink) {
+  if (sink->count > 0) {
+    if (sink->format == STATS_CSV)
+      write_csv(sink);
+    else
+      write_bin(sink);
+    sink->count = 0;
+  }
+  fflush(sink->fp);
+
+  if (clock_gettime(CLOCK_MONOTONIC, &sink->last_flush) == -1) {
+    perror("clock_gettime");
+    exit(1);
+  }
+}
+
+// Writes the records left in the batch once flush_ns has elapsed since the
+// last write, even when no record is pushed in the meantime. Waits for a push
+// while the batch is empty.
+static void * flush_thread(void *arg) {
+  struct StatsSink *sink = arg;
+  trace_thread_name("stats flush");
+  pthread_mutex_lock(&sink->mutex);
+  while (!sink->stop) {
+    if (sink->count == 0) {
+      pthread_cond_wait(&sink->wake, &sink->mutex);
+      continue;
+    }
+    struct timespec deadline = sink->last_flush;
+    deadline.tv_sec += sink->flush_ns / 1000000000LL;
+    deadline.tv_nsec += sink->flush_ns % 1000000000LL;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    if (pthread_cond_timedwait(&sink->wake, &sink->mutex, &deadline) == ETIMEDOUT && sink->count > 0) {
+      METRICS_SCOPE(STATS_SAVE_FS);
+      flush_locked(sink);
+    }
+  }
+  pthread_mutex_unlock(&sink->mutex);
+  return NULL;
+}
+
+static struct StatsSink * open_sink(const char *filename, enum StatsFormat format, int flush_records, int flush_ms, bool append) {
+  struct StatsSink *sink = malloc(sizeof(struct StatsSink));
+  if (sink == NULL) {
+    perror("cannot allocate stats sink");
+    exit(1);
+  }
+
+  if (append)
+    sink->fp = fopen(filename, format == STATS_CSV ? "a" : "ab");
+  else
+    sink->fp = fopen(filename, format == STATS_CSV ? "w" : "wb");
+  if (sink->fp == NULL) {
+    perror("cannot save stats to file");
+    exit(1);
+  }
+
+  sink->format = format;
+  sink->flush_records = flush_records > 0 ? flush_records : 1;
+  sink->flush_ns = (int64_t)flush_ms * 1000000LL;
+  sink->count = 0;
+  sink->records = malloc(sink->flush_records * sizeof(struct StatsRecord));
+  if (sink->records == NULL) {
+    perror("cannot allocate stats sink");
+    exit(1);
+  }
+  pthread_mutex_init(&sink->mutex, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sink->wake, &attr);
+  pthread_condattr_destroy(&attr);
+  sink->stop = false;
+
+  // an appended file already has its header
+  bool empty = ftell(sink->fp) == 0;
+  if (empty && format == STATS_CSV) {
+    fprintf(sink->fp, "step,min,max,mode,mean,median\n");
+  } else if (empty) {
+    struct StatsFileHeader header;
+    memcpy(header.magic, STATS_FILE_MAGIC, 4);
+    header.version = STATS_FILE_VERSION;
+    if (fwrite(&header, sizeof(header), 1, sink->fp) != 1) {
+      perror("cannot save stats to file");
+      exit(1);
+    }
+  }
+
+  if (clock_gettime(CLOCK_MONOTONIC, &sink->last_flush) == -1) {
+    perror("clock_gettime");
+    exit(1);
+  }
+  sink->has_flusher = sink->flush_ns > 0;
+  if (sink->has_flusher && pthread_create(&sink->flusher, NULL, flush_thread, sink) != 0) {
+    fprintf(stderr, "cannot create stats flush thread\n");
+    exit(1);
+  }
+  return sink;
+}
+
+struct StatsSink * stats_sink_open(const char *filename, enum StatsFormat format, int flush_records, int flush_ms) {
+  return open_sink(filename, format, flush_records, flush_ms, false);
+}
+
+// Returns the length of the prefix of `fp` holding only steps before
+// `first_step`. Binary files are cut at block granularity, which is exact as
+// long as the sink was flushed when the run reached `first_step`.
+static long kept_length(FILE *fp, enum StatsFormat format, int first_step) {
+  long kept = 0;
+  if (format == STATS_CSV) {
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      if (kept > 0 && atoi(line) >= first_step)
+        break;
+      kept = ftell(fp);
+    }
+    return kept;
+  }
+
+  struct StatsFileHeader file_header;
+  if (fread(&file_header, sizeof(file_header), 1, fp) != 1)
+    return 0;
+  kept = ftell(fp);
+
+  struct StatsBlockHeader header;
+  while (fread(&header, sizeof(header), 1, fp) == 1) {
+    int32_t step;
+    long block_start = kept;
+    if (fseek(fp, block_start + sizeof(header) + 2 * header.count * sizeof(double), SEEK_SET) != 0
+        || fread(&step, sizeof(step), 1, fp) != 1
+        || step >= first_step)
+      break;
+    kept = block_start + stats_block_size(header.count);
+    fseek(fp, kept, SEEK_SET);
+  }
+  return kept;
+}
+
+// Keeps the records of the steps before `first_step` already in `filename`,
+// e.g. when resuming a run from a checkpoint.
+struct StatsSink * stats_sink_append(const char *filename, enum StatsFormat format, int flush_records, int flush_ms, int first_step) {
+  FILE *fp = fopen(filename, "rb");
+  if (fp != NULL) {
+    long kept = kept_length(fp, format, first_step);
+    fclose(fp);
+    if (truncate(filename, kept) == -1) {
+      perror("cannot truncate stats file");
+      exit(1);
+    }
+  }
+  return open_sink(filename, format, flush_records, flush_ms, true);
+}
+
+void stats_sink_push(struct StatsSink *sink, const struct ImageStats *stats, int current_step) {
+  METRICS_SCOPE(STATS_SAVE_FS);
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == -1) {
+    perror("clock_gettime");
+    exit(1);
+  }
+
+  pthread_mutex_lock(&sink->mutex);
+  sink->records[sink->count].step = current_step;
+  sink->records[sink->count].stats = *stats;
+  sink->count++;
+
+  if (sink->count == sink->flush_records
+      || (sink->flush_ns > 0 && ns_diff(&sink->last_flush, &now) >= sink->flush_ns))
+    flush_locked(sink);
+  else if (sink->count == 1 && sink->has_flusher)
+    pthread_cond_signal(&sink->wake);
+
+  pthread_mutex_unlock(&sink->mutex);
+}
+
+void stats_sink_flush(struct StatsSink *sink) {
+  pthread_mutex_lock(&sink->mutex);
+  flush_locked(sink);
+  pthread_mutex_unlock(&sink->mutex);
+}
+
+int stats_sink_pending(struct StatsSink *sink) {
+  pthread_mutex_lock(&sink->mutex);
+  int count = sink->count;
+  pthread_mutex_unlock(&sink->mutex);
+  return count;
+}
+
+void stats_sink_close(struct StatsSink *sink) {
+  METRICS_SCOPE(STATS_SAVE_FS);
+
+  if (sink->has_flusher) {
+    pthread_mutex_lock(&sink->mutex);
+    sink->stop = true;
+    pthread_cond_signal(&sink->wake);
+    pthread_mutex_unlock(&sink->mutex);
+    pthread_join(sink->flusher, NULL);
+  }
+  stats_sink_flush(sink);
+  fclose(sink->fp);
+
+  pthread_cond_destroy(&sink->wake);
+  pthread_mutex_destroy(&sink->mutex);
+  free(sink->records);
+  free(sink);
+}
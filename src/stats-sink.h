@@ -0,0 +1,72 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "tasks.h"
+
+// A stats sink keeps the output file open for the whole run and batches
+// records in memory. The batch is written when it holds `flush_records`
+// records, when `flush_ms` elapsed since the last write, or on close. The
+// time threshold is checked by a thread of the sink, so pending records are
+// written even if no other record comes. Pushing is thread-safe.
+//
+// STATS_BIN files are made of blocks, one per flush, in native byte order so
+// that they can be mmap()ed and read in place:
+//   file  : struct StatsFileHeader, block*
+//   block : struct StatsBlockHeader, double mean[count], double median[count],
+//           int32_t step[count], uint8_t min[count], uint8_t max[count],
+//           uint8_t mode[count], zero padding up to a multiple of 8 bytes
+
+#define STATS_FILE_MAGIC "DMST"
+#define STATS_BLOCK_MAGIC "DMSB"
+#define STATS_FILE_VERSION 1
+
+enum StatsFormat {
+  STATS_CSV
+, STATS_BIN
+};
+
+struct StatsFileHeader {
+  char magic[4];
+  uint32_t version;
+};
+
+struct StatsBlockHeader {
+  char magic[4];
+  uint32_t count;
+};
+
+struct StatsRecord {
+  int step;
+  struct ImageStats stats;
+};
+
+struct StatsSink {
+  FILE *fp;
+  enum StatsFormat format;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;  // a first record pushed, or close
+  pthread_t flusher;  // only when flush_ns > 0
+  bool has_flusher;
+  bool stop;
+  struct StatsRecord *records;
+  int count;
+  int flush_records;
+  int64_t flush_ns;
+  struct timespec last_flush;
+};
+
+enum StatsFormat stats_format_from_env(void);
+size_t stats_block_size(uint32_t count);
+
+struct StatsSink * stats_sink_open(const char *filename, enum StatsFormat format, int flush_records, int flush_ms);
+struct StatsSink * stats_sink_append(const char *filename, enum StatsFormat format, int flush_records, int flush_ms, int first_step);
+void stats_sink_push(struct StatsSink *sink, const struct ImageStats *stats, int current_step);
+void stats_sink_flush(struct StatsSink *sink);
+// Records pushed but not written yet.
+int stats_sink_pending(struct StatsSink *sink);
+void stats_sink_close(struct StatsSink *sink);
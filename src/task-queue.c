@@ -0,0 +1,161 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "task-queue.h"
+
+static atomic_size_t * cell_seq(struct TaskQueue *q, size_t pos) {
+  return (atomic_size_t *)(q->cells + (pos & q->mask) * q->stride);
+}
+
+static void * cell_data(struct TaskQueue *q, size_t pos) {
+  return q->cells + (pos & q->mask) * q->stride + sizeof(atomic_size_t);
+}
+
+void futex_wait(atomic_uint *addr, unsigned int expected) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void futex_wake(atomic_uint *addr, int count) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void task_queue_init(struct TaskQueue *q, size_t capacity, size_t elem_size) {
+  size_t size = 2;
+  while (size < capacity)
+    size *= 2;
+
+  q->mask = size - 1;
+  q->elem_size = elem_size;
+  q->stride = (sizeof(atomic_size_t) + elem_size + alignof(atomic_size_t) - 1) & ~(alignof(atomic_size_t) - 1);
+  q->cells = aligned_alloc(CACHE_LINE_SIZE, (size * q->stride + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1));
+  if (q->cells == NULL) {
+    perror("cannot allocate task queue");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < size; i++)
+    atomic_init(cell_seq(q, i), i);
+  atomic_init(&q->enqueue_pos, 0);
+  atomic_init(&q->dequeue_pos, 0);
+  atomic_init(&q->not_empty_seq, 0);
+  atomic_init(&q->waiting_consumers, 0);
+  atomic_init(&q->not_full_seq, 0);
+  atomic_init(&q->waiting_producers, 0);
+}
+
+void task_queue_destroy(struct TaskQueue *q) {
+  free(q->cells);
+  q->cells = NULL;
+}
+
+bool task_queue_try_push(struct TaskQueue *q, const void *elem) {
+  size_t pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+  for (;;) {
+    atomic_size_t *seq = cell_seq(q, pos);
+    intptr_t diff = (intptr_t)atomic_load_explicit(seq, memory_order_acquire) - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->enqueue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+        memcpy(cell_data(q, pos), elem, q->elem_size);
+        atomic_exchange_explicit(seq, pos + 1, memory_order_seq_cst);
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // full
+    } else {
+      pos = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  // The sequence number is published with a seq_cst exchange (cheaper than a
+  // store + fence) so that it is ordered before reading the waiter count:
+  // either a parking consumer sees the element on its last try, or we see it
+  // waiting and wake it up.
+  if (atomic_load_explicit(&q->waiting_consumers, memory_order_seq_cst) > 0) {
+    atomic_fetch_add(&q->not_empty_seq, 1);
+    futex_wake(&q->not_empty_seq, 1);
+  }
+  return true;
+}
+
+bool task_queue_try_pop(struct TaskQueue *q, void *elem) {
+  size_t pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+  for (;;) {
+    atomic_size_t *seq = cell_seq(q, pos);
+    intptr_t diff = (intptr_t)atomic_load_explicit(seq, memory_order_acquire) - (intptr_t)(pos + 1);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&q->dequeue_pos, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+        memcpy(elem, cell_data(q, pos), q->elem_size);
+        atomic_exchange_explicit(seq, pos + q->mask + 1, memory_order_seq_cst);
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // empty
+    } else {
+      pos = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+    }
+  }
+
+  if (atomic_load_explicit(&q->waiting_producers, memory_order_seq_cst) > 0) {
+    atomic_fetch_add(&q->not_full_seq, 1);
+    futex_wake(&q->not_full_seq, 1);
+  }
+  return true;
+}
+
+void task_queue_push(struct TaskQueue *q, const void *elem) {
+  for (;;) {
+    if (task_queue_try_push(q, elem))
+      return;
+    for (int i = 0; i < spin_tries(); i++) {
+      cpu_relax();
+      if (task_queue_try_push(q, elem))
+        return;
+    }
+
+    atomic_fetch_add(&q->waiting_producers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned int seq = atomic_load(&q->not_full_seq);
+    if (task_queue_try_push(q, elem)) {
+      atomic_fetch_sub(&q->waiting_producers, 1);
+      return;
+    }
+    futex_wait(&q->not_full_seq, seq);
+    atomic_fetch_sub(&q->waiting_producers, 1);
+  }
+}
+
+void task_queue_pop(struct TaskQueue *q, void *elem) {
+  for (;;) {
+    if (task_queue_try_pop(q, elem))
+      return;
+    for (int i = 0; i < spin_tries(); i++) {
+      cpu_relax();
+      if (task_queue_try_pop(q, elem))
+        return;
+    }
+
+    atomic_fetch_add(&q->waiting_consumers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    unsigned int seq = atomic_load(&q->not_empty_seq);
+    if (task_queue_try_pop(q, elem)) {
+      atomic_fetch_sub(&q->waiting_consumers, 1);
+      return;
+    }
+    futex_wait(&q->not_empty_seq, seq);
+    atomic_fetch_sub(&q->waiting_consumers, 1);
+  }
+}
+
+// Approximate when other threads are pushing or popping concurrently.
+size_t task_queue_size(struct TaskQueue *q) {
+  size_t in = atomic_load_explicit(&q->enqueue_pos, memory_order_relaxed);
+  size_t out = atomic_load_explicit(&q->dequeue_pos, memory_order_relaxed);
+  return in > out ? in - out : 0;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <unistd.h>
+
+// Bounded lock-free multi-producer/multi-consumer queue (D. Vyukov's
+// sequence-numbered ring). Each cell carries a sequence number telling
+// whether it is ready to be written (seq == pos) or read (seq == pos + 1), so
+// producers and consumers only contend on their own position counter.
+//
+// Elements are copied in and out and may be of any fixed size. The blocking
+// variants spin briefly, then park the thread on a futex; the other side only
+// issues a wake-up syscall when somebody is actually parked.
+
+#define CACHE_LINE_SIZE 64
+
+struct TaskQueue {
+  size_t mask;
+  size_t elem_size;
+  size_t stride;
+  unsigned char *cells;
+
+  alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+  alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+
+  alignas(CACHE_LINE_SIZE) atomic_uint not_empty_seq;
+  atomic_int waiting_consumers;
+  alignas(CACHE_LINE_SIZE) atomic_uint not_full_seq;
+  atomic_int waiting_producers;
+};
+
+// Parking primitives, also used by the dm-v2 scheduler.
+void futex_wait(atomic_uint *addr, unsigned int expected);
+void futex_wake(atomic_uint *addr, int count);
+
+#define SPIN_TRIES 64
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+// Spinning only pays off when the other side can run at the same time.
+static inline int spin_tries(void) {
+  static int tries = -1;
+  if (tries < 0)
+    tries = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SPIN_TRIES : 0;
+  return tries;
+}
+
+// `capacity` is rounded up to a power of two.
+void task_queue_init(struct TaskQueue *q, size_t capacity, size_t elem_size);
+void task_queue_destroy(struct TaskQueue *q);
+
+bool task_queue_try_push(struct TaskQueue *q, const void *elem);
+bool task_queue_try_pop(struct TaskQueue *q, void *elem);
+void task_queue_push(struct TaskQueue *q, const void *elem);
+void task_queue_pop(struct TaskQueue *q, void *elem);
+size_t task_queue_size(struct TaskQueue *q);
@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <float.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,11 +10,17 @@
 #include <time.h>
 
 #include <unistd.h>
-#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include <png.h>
 
 #include "tasks.h"
+#include "metrics.h"
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+#define MPOL_PREFERRED 1
 
 // global variables
 const double x_min = -60;
@@ -21,7 +28,6 @@ const double x_max = 80;
 const double y_min = -30;
 const double y_max = 30;
 
-int64_t cum_ns[STEP_MAX] = {0};
 const char * step_cstr[STEP_MAX] = {
   "nbodies_simulation"
 , "image_generation"
@@ -32,25 +38,251 @@ const char * step_cstr[STEP_MAX] = {
 , "stats_save_fs"
 };
 
+int env_int(const char *name, int default_value) {
+  const char *value = getenv(name);
+  if (value == NULL || *value == '\0')
+    return default_value;
+
+  char *end;
+  long parsed = strtol(value, &end, 10);
+  if (*end != '\0') {
+    fprintf(stderr, "invalid value for %s: '%s'\n", name, value);
+    exit(1);
+  }
+  return parsed;
+}
+
+void init_bodies(struct Body bodies[N_BODIES], unsigned int seed) {
+  const struct Body solar_system[N_BODIES] = {
+    { 0.00, 0.0,  0.000, 0.0,      1.0, 0.00465047,  5.0e2,  255, 204,   0},
+    { 0.39, 0.0,  0.323, 0.0,  1.65e-7,   1.765e-5, 10.0e3,  169, 169, 169},
+    { 0.72, 0.0,  0.218, 0.0,  2.45e-6,   4.552e-5, 10.0e3,  255, 204, 153},
+    { 1.00, 0.0,  0.170, 0.0,  3.00e-6,   4.258e-5, 10.0e3,    0, 102, 204},
+    { 1.52, 0.0,  0.128, 0.0,  3.21e-7,   2.279e-5, 10.0e3,  255, 102,   0},
+    { 5.20, 0.0,  0.060, 0.0,  9.55e-4,  4.7789e-4,  5.0e3,   204, 153, 102},
+    { 9.58, 0.0,  0.043, 0.0,  2.86e-4,  4.0072e-4,  5.0e3,   210, 180, 140},
+    {19.22, 0.0,  0.030, 0.0,  4.36e-5,  1.6938e-4,  5.0e3,   173, 216, 230},
+    {30.05, 0.0,  0.024, 0.0,  5.17e-5,  1.6418e-4,  5.0e3,     0,   0, 128},
+  };
+  memcpy(bodies, solar_system, sizeof(solar_system));
+
+  srand(seed);
+
+  for (int i = 1; i < N_BODIES; ++i) {
+    double dist = bodies[i].x;
+    double angle = 2 * M_PI * (double)rand() / RAND_MAX;
+    bodies[i].x = dist * cos(angle);
+    bodies[i].y = dist * sin(angle);
+
+    double rot_speed = bodies[i].vx;
+    bodies[i].vx = -rot_speed * bodies[i].y;
+    bodies[i].vy =  rot_speed * bodies[i].x;
+  }
+}
+
+int substeps_from_env(void) {
+  int substeps = env_int("DM_SUBSTEPS", 1);
+  return substeps > 0 ? substeps : 1;
+}
+
+enum Integrator integrator = INTEGRATOR_EULER;
+static int block_max_level = 6;
+static double block_eta = 0.02;
+
+// Force evaluations of the block integrator, and what a uniform step at the
+// finest level used would have needed.
+static atomic_long block_forces;
+static atomic_long block_uniform_forces;
+
+// Level and next activation tick of each body. dm-v2 advances several
+// scenarios at once, so each thread grows its own buffers and keeps them.
+struct BlockScratch {
+  int capacity;
+  int *level;
+  long *next;
+};
+
+static _Thread_local struct BlockScratch block_scratch;
+
+static void block_scratch_reserve(int n) {
+  struct BlockScratch *s = &block_scratch;
+  if (n <= s->capacity)
+    return;
+  int *level = realloc(s->level, n * sizeof(int));
+  long *next = level != NULL ? realloc(s->next, n * sizeof(long)) : NULL;
+  if (level == NULL || next == NULL) {
+    perror("cannot allocate block timestep state");
+    exit(1);
+  }
+  account_alloc(ALLOC_BODIES, (size_t)(n - s->capacity) * (sizeof(int) + sizeof(long)));
+  s->level = level;
+  s->next = next;
+  s->capacity = n;
+}
+
+void integrator_init_from_env(void) {
+  const char *name = getenv("DM_INTEGRATOR");
+  if (name == NULL || *name == '\0' || strcmp(name, "euler") == 0) {
+    integrator = INTEGRATOR_EULER;
+  } else if (strcmp(name, "block") == 0) {
+    integrator = INTEGRATOR_BLOCK;
+  } else {
+    fprintf(stderr, "invalid value for DM_INTEGRATOR: '%s' (euler or block)\n", name);
+    exit(1);
+  }
+
+  block_max_level = env_int("DM_BLOCK_LEVELS", 6);
+  if (block_max_level < 0 || block_max_level > 30) {
+    fprintf(stderr, "invalid value for DM_BLOCK_LEVELS: %d (0 to 30)\n", block_max_level);
+    exit(1);
+  }
+  const char *eta = getenv("DM_BLOCK_ETA");
+  if (eta != NULL && *eta != '\0') {
+    char *end;
+    block_eta = strtod(eta, &end);
+    if (*end != '\0' || !(block_eta > 0)) {
+      fprintf(stderr, "invalid value for DM_BLOCK_ETA: '%s'\n", eta);
+      exit(1);
+    }
+  }
+}
+
+uint32_t integrator_key(void) {
+  if (integrator == INTEGRATOR_EULER)
+    return 0;
+  // FNV-1a
+  uint32_t h = 0x811c9dc5u;
+  const int32_t fields[2] = { integrator, block_max_level };
+  const uint8_t *bytes[2] = { (const uint8_t *)fields, (const uint8_t *)&block_eta };
+  const size_t sizes[2] = { sizeof(fields), sizeof(block_eta) };
+  for (int f = 0; f < 2; f++) {
+    for (size_t i = 0; i < sizes[f]; i++) {
+      h ^= bytes[f][i];
+      h *= 0x01000193u;
+    }
+  }
+  return h != 0 ? h : 1;
+}
+
 void set_img_blank(struct Image * img) {
   memset(img->data, 0, 3 * img->width * img->height);
 }
 
-struct Image * alloc_img(int width, int height) {
+// Frames are mapped rather than malloc()ed: the kernel hands out zeroed pages
+// on first touch, so there is nothing to blank here and each page is
+// committed, on its node, by the worker that first writes the frame.
+// DM_HUGEPAGES selects the page size: 0 = regular pages, 1 = transparent huge
+// pages advice (default), 2 = MAP_HUGETLB, falling back to regular pages when
+// no huge page is reserved.
+struct Image * alloc_img_on_node(int width, int height, int node) {
   struct Image * img = malloc(sizeof(struct Image));
+  if (img == NULL)
+    return NULL;
   img->width = width;
   img->height = height;
-  img->data = (uint8_t *)malloc(3 * img->width * img->height * sizeof(uint8_t));
-  set_img_blank(img);
+
+  size_t size = 3 * (size_t)width * height * sizeof(uint8_t);
+  int hugepages = env_int("DM_HUGEPAGES", 1);
+  void * data = MAP_FAILED;
+
+  if (hugepages == 2) {
+    img->mapped_size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    data = mmap(NULL, img->mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  }
+  if (data == MAP_FAILED) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    img->mapped_size = (size + page_size - 1) & ~(page_size - 1);
+    data = mmap(NULL, img->mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      free(img);
+      return NULL;
+    }
+    if (hugepages == 1 && img->mapped_size >= HUGE_PAGE_SIZE)
+      madvise(data, img->mapped_size, MADV_HUGEPAGE);
+  }
+
+  if (node >= 0) {
+    // Preferred rather than bound: fall back to other nodes instead of failing.
+    unsigned long nodemask[4] = {0};
+    if (node < (int)(8 * sizeof(nodemask)))
+      nodemask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, data, img->mapped_size, MPOL_PREFERRED, nodemask, 8 * sizeof(nodemask), 0);
+  }
+
+  img->data = data;
+  account_alloc(ALLOC_IMAGES, img->mapped_size);
   return img;
 }
 
+struct Image * alloc_img(int width, int height) {
+  return alloc_img_on_node(width, height, -1);
+}
+
 void free_img(struct Image * img) {
-  free(img->data);
+  account_free(ALLOC_IMAGES, img->mapped_size);
+  munmap(img->data, img->mapped_size);
   img->data = NULL;
   free(img);
 }
 
+static const char * alloc_cstr[ALLOC_KINDS] = {
+  [ALLOC_IMAGES] = "images",
+  [ALLOC_BODIES] = "corps",
+  [ALLOC_PNG_ROWS] = "lignes PNG",
+};
+
+struct AllocCounters {
+  atomic_int_fast64_t allocations;
+  atomic_int_fast64_t allocated;
+  atomic_int_fast64_t live;
+  atomic_int_fast64_t peak;
+};
+
+// The last slot counts all kinds together: its peak is that of the sum.
+static struct AllocCounters alloc_counters[ALLOC_KINDS + 1];
+
+static void raise_peak(atomic_int_fast64_t *peak, int64_t value) {
+  int_fast64_t old = atomic_load_explicit(peak, memory_order_relaxed);
+  while (old < value && !atomic_compare_exchange_weak_explicit(peak, &old, value, memory_order_relaxed,
+                                                              memory_order_relaxed))
+    ;
+}
+
+void account_alloc(enum AllocKind kind, size_t bytes) {
+  struct AllocCounters *counters[] = { &alloc_counters[kind], &alloc_counters[ALLOC_KINDS] };
+  for (int i = 0; i < 2; i++) {
+    struct AllocCounters *c = counters[i];
+    atomic_fetch_add_explicit(&c->allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&c->allocated, bytes, memory_order_relaxed);
+    raise_peak(&c->peak, atomic_fetch_add_explicit(&c->live, bytes, memory_order_relaxed) + bytes);
+  }
+}
+
+void account_free(enum AllocKind kind, size_t bytes) {
+  atomic_fetch_sub_explicit(&alloc_counters[kind].live, bytes, memory_order_relaxed);
+  atomic_fetch_sub_explicit(&alloc_counters[ALLOC_KINDS].live, bytes, memory_order_relaxed);
+}
+
+static void print_memory_stats(void) {
+  printf("\nmémoire\n");
+  printf("  %19s  %12s  %14s  %14s  %14s\n", "catégorie", "allocations", "allouée (Kio)", "vivante (Kio)",
+         "pic (Kio)");
+  for (int kind = 0; kind <= ALLOC_KINDS; kind++) {
+    const struct AllocCounters *c = &alloc_counters[kind];
+    printf("  %19s  %12ld  %14.1f  %14.1f  %14.1f\n", kind < ALLOC_KINDS ? alloc_cstr[kind] : "total",
+           (long)atomic_load(&c->allocations), atomic_load(&c->allocated) / 1024.0,
+           atomic_load(&c->live) / 1024.0, atomic_load(&c->peak) / 1024.0);
+  }
+
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == -1) {
+    perror("getrusage");
+    return;
+  }
+  printf("  pic RSS : %.2f Mio, défauts de page : %ld mineurs, %ld majeurs\n", usage.ru_maxrss / 1024.0,
+         usage.ru_minflt, usage.ru_majflt);
+}
+
 int64_t ns_diff(const struct timespec *t0, const struct timespec *t1) {
   int64_t s_diff = t1->tv_sec - t0->tv_sec;
   int64_t ns_diff = t1->tv_nsec - t0->tv_nsec;
@@ -74,22 +306,95 @@ void print_duration(const char * prefix, int64_t ns, int64_t total_ns) {
   }
 }
 
+static int64_t frame_pixels = 0;
+
+void report_frame_size(int width, int height) {
+  frame_pixels = (int64_t)width * height;
+}
+
+#ifndef DM_NO_INSTRUMENT
+static void print_counter(enum PerfCounter counter, double value, const char *format) {
+  if (perf_counter_available(counter))
+    printf(format, value);
+  else
+    printf("  %12s", "-");
+}
+
+// Memory traffic is estimated as one cache line per last-level cache miss.
+static void print_counters(const struct StageReport report[STEP_MAX]) {
+  const bool per_pixel[STEP_MAX] = {
+    [IMAGE_GENERATION] = true, [IMAGE_GAUSSIAN_BLUR] = true, [IMAGE_SAVE_FS] = true,
+    [IMAGE_GRAYSCALE] = true, [IMAGE_STATS] = true,
+  };
+
+  printf("\ncompteurs matériels (DM_PERF)\n");
+  printf("  %19s  %12s  %12s  %12s  %12s  %12s  %12s\n",
+         "étape", "cycles (M)", "instr. (M)", "IPC", "miss LLC (k)", "octets/pixel", "miss br. (k)");
+  for (int step = STEP_MIN; step < STEP_MAX; ++step) {
+    const int64_t *v = report[step].perf;
+    printf("  %19s", step_cstr[step]);
+    print_counter(PERF_CYCLES, v[PERF_CYCLES] / 1e6, "  %12.2f");
+    print_counter(PERF_INSTRUCTIONS, v[PERF_INSTRUCTIONS] / 1e6, "  %12.2f");
+    if (perf_counter_available(PERF_INSTRUCTIONS) && v[PERF_CYCLES] > 0)
+      printf("  %12.2f", (double)v[PERF_INSTRUCTIONS] / v[PERF_CYCLES]);
+    else
+      printf("  %12s", "-");
+    print_counter(PERF_LLC_MISSES, v[PERF_LLC_MISSES] / 1e3, "  %12.1f");
+    int64_t pixels = report[step].calls * frame_pixels;
+    if (per_pixel[step] && pixels > 0 && perf_counter_available(PERF_LLC_MISSES))
+      printf("  %12.3f", 64.0 * v[PERF_LLC_MISSES] / pixels);
+    else
+      printf("  %12s", "-");
+    print_counter(PERF_BRANCH_MISSES, v[PERF_BRANCH_MISSES] / 1e3, "  %12.1f");
+    printf("\n");
+  }
+}
+#endif
+
+// The first table gives, for each step, the time during which at least one
+// thread was in it, so that parallel steps stay below 100 % of the total. The
+// second one gives the time summed over threads, the CPU time and the
+// latency of one call, then come the hardware counters (DM_PERF=1) and the
+// memory report.
 void print_elapsed_time_stats(int64_t total_ns) {
   print_duration("temps total", total_ns, total_ns);
+#ifdef DM_NO_INSTRUMENT
+  printf("\ndétail par étape : non mesuré (compilé avec DM_NO_INSTRUMENT)\n");
+#else
+  struct StageReport report[STEP_MAX];
+  metrics_collect(report);
+
   printf("\ndétail par étape\n");
   for (int step = STEP_MIN; step < STEP_MAX; ++step) {
-    print_duration(step_cstr[step], cum_ns[step], total_ns);
+    print_duration(step_cstr[step], report[step].wall_ns, total_ns);
   }
-}
 
-void simulate_n_bodies(struct Body bodies[], int n, double dt) {
-  struct timespec t0, t1;
-  if (clock_gettime(CLOCK_BOOTTIME, &t0) == -1) {
-    perror("clock_gettime");
-    exit(1);
+  printf("\n  %19s  %8s  %12s  %12s  %10s  %10s  %10s\n",
+         "étape", "appels", "occupé (ms)", "cpu (ms)", "p50 (us)", "p95 (us)", "p99 (us)");
+  for (int step = STEP_MIN; step < STEP_MAX; ++step) {
+    const struct StageReport *r = &report[step];
+    char cpu[32] = "-";
+    if (r->has_cpu)
+      snprintf(cpu, sizeof(cpu), "%.3f", r->cpu_ns / 1e6);
+    printf("  %19s  %8ld  %12.3f  %12s  %10.1f  %10.1f  %10.1f\n", step_cstr[step], r->calls,
+           r->busy_ns / 1e6, cpu, metrics_percentile(r, 0.50) / 1e3,
+           metrics_percentile(r, 0.95) / 1e3, metrics_percentile(r, 0.99) / 1e3);
   }
 
-  for (int i = 0; i < n; i++) {
+  if (perf_on && perf_counter_available(PERF_CYCLES))
+    print_counters(report);
+#endif
+  if (integrator == INTEGRATOR_BLOCK) {
+    long forces = atomic_load(&block_forces);
+    long uniform = atomic_load(&block_uniform_forces);
+    printf("\npas par blocs : %ld évaluations de forces, %ld au pas le plus fin pour tous (x%.1f)\n", forces, uniform,
+           forces > 0 ? (double)uniform / forces : 0.0);
+  }
+  print_memory_stats();
+}
+
+void simulate_n_bodies_velocities(struct Body bodies[], int n, double dt, int begin, int end) {
+  for (int i = begin; i < end; i++) {
     double ax = 0;
     double ay = 0;
 
@@ -108,27 +413,121 @@ void simulate_n_bodies(struct Body bodies[], int n, double dt) {
     bodies[i].vx += ax * dt;
     bodies[i].vy += ay * dt;
   }
+}
 
-  for (int i = 0; i < n; i++) {
+void move_n_bodies(struct Body bodies[], double dt, int begin, int end) {
+  for (int i = begin; i < end; i++) {
     bodies[i].x += bodies[i].vx * dt;
     bodies[i].y += bodies[i].vy * dt;
   }
+}
 
-  if (clock_gettime(CLOCK_BOOTTIME, &t1) == -1) {
-    perror("clock_gettime");
-    exit(1);
+void simulate_n_bodies(struct Body bodies[], int n, double dt) {
+  METRICS_SCOPE(NBODIES_SIMULATION);
+
+  simulate_n_bodies_velocities(bodies, n, dt, 0, n);
+  move_n_bodies(bodies, dt, 0, n);
+}
+
+// Same sum as simulate_n_bodies_velocities, so that a single level reproduces
+// the euler integrator bit for bit, plus the smallest d^3 / (G (mi + mj)).
+static void block_acceleration(const struct Body bodies[], int n, int i, double *ax_out, double *ay_out,
+                               double *tau2_out) {
+  double ax = 0;
+  double ay = 0;
+  double tau2 = DBL_MAX;
+
+  for (int j = 0; j < n; j++) {
+    if (i != j) {
+      double dx = bodies[j].x - bodies[i].x;
+      double dy = bodies[j].y - bodies[i].y;
+      double distance_squared = dx * dx + dy * dy;
+      double distance = sqrt(distance_squared);
+      double force = (G * bodies[i].mass * bodies[j].mass) / distance_squared;
+      ax += force * dx / (distance * bodies[i].mass);
+      ay += force * dy / (distance * bodies[i].mass);
+      double pair_tau2 = distance_squared * distance / (G * (bodies[i].mass + bodies[j].mass));
+      if (pair_tau2 < tau2)
+        tau2 = pair_tau2;
+    }
   }
-  cum_ns[NBODIES_SIMULATION] += ns_diff(&t0, &t1);
+
+  *ax_out = ax;
+  *ay_out = ay;
+  *tau2_out = tau2;
 }
 
-void generate_image_from_bodies(struct Body bodies[], int n, struct Image * img) {
-  struct timespec t0, t1;
-  if (clock_gettime(CLOCK_BOOTTIME, &t0) == -1) {
-    perror("clock_gettime");
-    exit(1);
+// The step is cut into 2^block_max_level ticks. A body of level l is active
+// every 2^(block_max_level - l) ticks: its acceleration is evaluated at the
+// current positions and its velocity kicked for dt / 2^l. Between two
+// activations of any body, every body drifts. A body may move to a finer
+// level at any activation, to a coarser one only where both grids meet.
+void simulate_block_step(struct Body bodies[], int n, double dt) {
+  const long ticks = 1L << block_max_level;
+  block_scratch_reserve(n);
+  int *level = block_scratch.level;
+  long *next = block_scratch.next;
+  for (int i = 0; i < n; i++) {
+    level[i] = 0;
+    next[i] = 0;
+  }
+
+  long forces = 0;
+  int deepest = 0;
+  long t = 0;
+  while (t < ticks) {
+    for (int i = 0; i < n; i++) {
+      if (next[i] != t)
+        continue;
+      double ax, ay, tau2;
+      block_acceleration(bodies, n, i, &ax, &ay, &tau2);
+      forces++;
+
+      double wanted = block_eta * sqrt(tau2);
+      int l = 0;
+      while (l < block_max_level && dt / (1L << l) > wanted)
+        l++;
+      while (l < level[i] && t % (ticks >> l) != 0)
+        l++;
+      level[i] = l;
+      if (l > deepest)
+        deepest = l;
+
+      double kick = dt / (1L << l);
+      bodies[i].vx += ax * kick;
+      bodies[i].vy += ay * kick;
+      next[i] = t + (ticks >> l);
+    }
+
+    long t_next = ticks;
+    for (int i = 0; i < n; i++) {
+      if (next[i] < t_next)
+        t_next = next[i];
+    }
+    // A power-of-two fraction of dt: exact, and exactly dt for one level.
+    move_n_bodies(bodies, dt / ticks * (t_next - t), 0, n);
+    t = t_next;
   }
 
-  set_img_blank(img);
+  atomic_fetch_add_explicit(&block_forces, forces, memory_order_relaxed);
+  atomic_fetch_add_explicit(&block_uniform_forces, (long)n << deepest, memory_order_relaxed);
+}
+
+void simulate_substeps(struct Body bodies[], int n, double dt, int substeps) {
+  if (integrator == INTEGRATOR_BLOCK) {
+    METRICS_SCOPE(NBODIES_SIMULATION);
+    for (int s = 0; s < substeps; s++)
+      simulate_block_step(bodies, n, dt);
+    return;
+  }
+  for (int s = 0; s < substeps; s++)
+    simulate_n_bodies(bodies, n, dt);
+}
+
+// Only the pixels of rows [y0, y1) are written, so that disjoint row ranges
+// can be generated concurrently.
+void generate_image_rows(struct Body bodies[], int n, struct Image * img, int y0, int y1) {
+  memset(img->data + 3 * y0 * img->width, 0, 3 * (y1 - y0) * img->width);
 
   for (int i = 0; i < n; i++) {
     int x = (bodies[i].x - x_min) / (x_max - x_min) * img->width;
@@ -141,7 +540,7 @@ void generate_image_from_bodies(struct Body bodies[], int n, struct Image * img)
       for (int dy = -r; dy <= r; dy++) {
         int nx = x + dx;
         int ny = y + dy;
-        if (nx >= 0 && nx < img->width && ny >= 0 && ny < img->height) {
+        if (nx >= 0 && nx < img->width && ny >= y0 && ny < y1) {
           int dist_squared = dx * dx + dy * dy;
           if (dist_squared <= r_squared) {
             int idx = 3 * (ny * img->width + nx);
@@ -153,21 +552,15 @@ void generate_image_from_bodies(struct Body bodies[], int n, struct Image * img)
       }
     }
   }
-
-  if (clock_gettime(CLOCK_BOOTTIME, &t1) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
-  cum_ns[IMAGE_GENERATION] += ns_diff(&t0, &t1);
 }
 
-void apply_gaussian_blur(struct Image *img_in, struct Image *img_out) {
-  struct timespec t0, t1;
-  if (clock_gettime(CLOCK_BOOTTIME, &t0) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
+void generate_image_from_bodies(struct Body bodies[], int n, struct Image * img) {
+  METRICS_SCOPE(IMAGE_GENERATION);
+
+  generate_image_rows(bodies, n, img, 0, img->height);
+}
 
+void apply_gaussian_blur_rows(struct Image *img_in, struct Image *img_out, int y0, int y1) {
   const int kernel_size = 5;
   const double sigma = 1.0;
   double kernel[kernel_size][kernel_size];
@@ -189,9 +582,7 @@ void apply_gaussian_blur(struct Image *img_in, struct Image *img_out) {
     }
   }
 
-  set_img_blank(img_out);
-
-  for (int y = 0; y < img_in->height; y++) {
+  for (int y = y0; y < y1; y++) {
     for (int x = 0; x < img_in->width; x++) {
       double r = 0, g = 0, b = 0;
       for (int ky = 0; ky < kernel_size; ky++) {
@@ -212,66 +603,54 @@ void apply_gaussian_blur(struct Image *img_in, struct Image *img_out) {
       img_out->data[idx + 2] = (uint8_t)b;
     }
   }
-
-  if (clock_gettime(CLOCK_BOOTTIME, &t1) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
-  cum_ns[IMAGE_GAUSSIAN_BLUR] += ns_diff(&t0, &t1);
 }
 
-void convert_to_grayscale(struct Image *img_in, struct Image *img_out) {
-  struct timespec t0, t1;
-  if (clock_gettime(CLOCK_BOOTTIME, &t0) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
+void apply_gaussian_blur(struct Image *img_in, struct Image *img_out) {
+  METRICS_SCOPE(IMAGE_GAUSSIAN_BLUR);
+
+  apply_gaussian_blur_rows(img_in, img_out, 0, img_in->height);
+}
 
-  for (int i = 0; i < img_in->width * img_in->height; i++) {
+void convert_to_grayscale_rows(struct Image *img_in, struct Image *img_out, int y0, int y1) {
+  for (int i = y0 * img_in->width; i < y1 * img_in->width; i++) {
     int idx = 3 * i;
     uint8_t gray = (uint8_t)(0.299 * img_in->data[idx] + 0.587 * img_in->data[idx + 1] + 0.114 * img_in->data[idx + 2]);
     img_out->data[idx] = img_out->data[idx + 1] = img_out->data[idx + 2] = gray;
   }
+}
 
-  if (clock_gettime(CLOCK_BOOTTIME, &t1) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
-  cum_ns[IMAGE_GRAYSCALE] += ns_diff(&t0, &t1);
+void convert_to_grayscale(struct Image *img_in, struct Image *img_out) {
+  METRICS_SCOPE(IMAGE_GRAYSCALE);
+
+  convert_to_grayscale_rows(img_in, img_out, 0, img_in->height);
 }
 
-void compute_image_statistics(const struct Image *img, struct ImageStats *stats) {
-  struct timespec t0, t1;
-  if (clock_gettime(CLOCK_BOOTTIME, &t0) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
+// Adds the gray levels of rows [y0, y1) to `histogram`.
+void accumulate_histogram_rows(const struct Image *img, int histogram[256], int y0, int y1) {
+  for (int i = y0 * img->width; i < y1 * img->width; i++)
+    histogram[img->data[3 * i]]++;
+}
 
+void image_statistics_from_histogram(const int histogram[256], int total_count, struct ImageStats *stats) {
   stats->min = 255;
   stats->max = 0;
   stats->mode = 0;
 
-  int histogram[256] = {0};
+  // The sum of gray levels is an integer well below 2^53, so it is the same
+  // whether it is accumulated per pixel or per histogram bin.
   double sum = 0;
-
-  for (int i = 0; i < img->width * img->height; i++) {
-    int idx = 3 * i;
-    uint8_t gray = img->data[idx];
-
-    sum += gray;
-    histogram[gray]++;
-    if (gray < stats->min) stats->min = gray;
-    if (gray > stats->max) stats->max = gray;
-  }
-  
   int median1 = -1, median2 = -1;
   int max_count = 0;
   int cumulative_count = 0;
-  int total_count = img->width * img->height;
   int mid1 = total_count / 2 - 1;
   int mid2 = total_count / 2;
 
   for (int i = 0; i < 256; ++i) {
+    if (histogram[i] > 0) {
+      if (i < stats->min) stats->min = i;
+      stats->max = i;
+      sum += (double)i * histogram[i];
+    }
     if (histogram[i] > max_count) {
       max_count = histogram[i];
       stats->mode = i;
@@ -288,51 +667,18 @@ void compute_image_statistics(const struct Image *img, struct ImageStats *stats)
 
   stats->mean = sum / (total_count);
   stats->median = (median1 + median2) / 2.0;
-
-  if (clock_gettime(CLOCK_BOOTTIME, &t1) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
-  cum_ns[IMAGE_STATS] += ns_diff(&t0, &t1);
 }
 
-void save_stats(const struct ImageStats *stats, const char *filename, int current_step) {
-  struct timespec t0, t1;
-  if (clock_gettime(CLOCK_BOOTTIME, &t0) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
-
-  struct stat buffer;
-  bool exists = (stat(filename, &buffer) == 0);
-
-  FILE *file = fopen(filename, "a");
-
-  if (file == NULL) {
-    perror("cannot save stats to file");
-    exit(1);
-  }
-
-  if (!exists) {
-    fprintf(file, "step,min,max,mode,mean,median\n");
-  }
-
-  fprintf(file, "%d,%d,%d,%d,%.2f,%.2f\n", current_step, stats->min, stats->max, stats->mode, stats->mean, stats->median);
-  fclose(file);
+void compute_image_statistics(const struct Image *img, struct ImageStats *stats) {
+  METRICS_SCOPE(IMAGE_STATS);
 
-  if (clock_gettime(CLOCK_BOOTTIME, &t1) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
-  cum_ns[STATS_SAVE_FS] += ns_diff(&t0, &t1);
+  int histogram[256] = {0};
+  accumulate_histogram_rows(img, histogram, 0, img->height);
+  image_statistics_from_histogram(histogram, img->width * img->height, stats);
 }
 
 void save_img_as_png(const struct Image *img, const char *filename_format, int current_step) {
-  struct timespec t0, t1;
-  if (clock_gettime(CLOCK_BOOTTIME, &t0) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
+  METRICS_SCOPE(IMAGE_SAVE_FS);
 
   char filename[256];
   snprintf(filename, 256, filename_format, current_step);
@@ -367,6 +713,7 @@ void save_img_as_png(const struct Image *img, const char *filename_format, int c
   png_write_info(png, info);
 
   png_bytep row = (png_bytep)malloc(3 * img->width * sizeof(png_byte));
+  account_alloc(ALLOC_PNG_ROWS, 3 * img->width * sizeof(png_byte));
   for (int y = 0; y < img->height; y++) {
     memcpy(row, &img->data[y * img->width * 3], 3 * img->width);
     png_write_row(png, row);
@@ -376,10 +723,5 @@ void save_img_as_png(const struct Image *img, const char *filename_format, int c
   fclose(fp);
   png_destroy_write_struct(&png, &info);
   free(row);
-
-  if (clock_gettime(CLOCK_BOOTTIME, &t1) == -1) {
-    perror("clock_gettime");
-    exit(1);
-  }
-  cum_ns[IMAGE_SAVE_FS] += ns_diff(&t0, &t1);
+  account_free(ALLOC_PNG_ROWS, 3 * img->width * sizeof(png_byte));
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define N_BODIES 9
@@ -23,6 +24,7 @@ struct Image {
   uint8_t *data;
   int width;
   int height;
+  size_t mapped_size;
 };
 
 struct ImageStats {
@@ -45,21 +47,84 @@ enum Step {
 , STEP_MIN = NBODIES_SIMULATION
 };
 
+// Name of each step in reports and traces.
+extern const char * step_cstr[STEP_MAX];
+
+// Functions related to configuration.
+int env_int(const char *name, int default_value);
+
+// Functions related to the simulated scene.
+void init_bodies(struct Body bodies[N_BODIES], unsigned int seed);
+// DM_SUBSTEPS: simulation steps per rendered frame (1 by default). A frame
+// still covers one unit of time, so each substep advances by 1 / substeps;
+// trajectory caches and checkpoints are keyed on that dt.
+int substeps_from_env(void);
+
+// DM_INTEGRATOR: "euler" (default) advances every body with the same dt;
+// "block" gives each body a power-of-two fraction dt / 2^level of the step,
+// chosen from the dynamical time of its closest pair (DM_BLOCK_ETA times
+// it, 0.02 by default), with at most DM_BLOCK_LEVELS levels (6 by default).
+// Forces are only recomputed for the bodies whose own step starts, while every
+// body drifts between these instants, so positions stay synchronised.
+enum Integrator {
+  INTEGRATOR_EULER,
+  INTEGRATOR_BLOCK,
+};
+
+extern enum Integrator integrator;
+
+void integrator_init_from_env(void);
+// 0 for euler, otherwise a hash of the integrator and its parameters: it keys
+// trajectory caches and checkpoints next to dt.
+uint32_t integrator_key(void);
+
 // Functions related to basic image manipulation.
 void set_img_blank(struct Image * img);
 struct Image * alloc_img(int width, int height);
+struct Image * alloc_img_on_node(int width, int height, int node);
 void free_img(struct Image * img);
 
+// Functions related to memory accounting. Bytes are counted when a buffer is
+// allocated and freed, whether or not its pages are committed yet; the
+// report puts them next to the peak RSS and the page faults of the process.
+enum AllocKind {
+  ALLOC_IMAGES
+, ALLOC_BODIES
+, ALLOC_PNG_ROWS
+, ALLOC_KINDS
+};
+
+void account_alloc(enum AllocKind kind, size_t bytes);
+void account_free(enum AllocKind kind, size_t bytes);
+
 // Functions related to time measurement and stats.
 int64_t ns_diff(const struct timespec *t0, const struct timespec *t1);
 void print_duration(const char * prefix, int64_t ns, int64_t total_ns);
+// Also prints the memory report.
 void print_elapsed_time_stats(int64_t total_ns);
+// Image size used to report memory traffic per pixel.
+void report_frame_size(int width, int height);
 
 // Functions that implement tasks.
 void simulate_n_bodies(struct Body bodies[], int n, double dt);
+// `substeps` calls of simulate_n_bodies, or of simulate_block_step with
+// DM_INTEGRATOR=block, with no image work in between.
+void simulate_substeps(struct Body bodies[], int n, double dt, int substeps);
+// One step of dt with block timesteps (untimed).
+void simulate_block_step(struct Body bodies[], int n, double dt);
 void generate_image_from_bodies(struct Body bodies[], int n, struct Image * img);
 void apply_gaussian_blur(struct Image *img_in, struct Image *img_out);
 void convert_to_grayscale(struct Image *img_in, struct Image *img_out);
 void compute_image_statistics(const struct Image *img, struct ImageStats *stats);
-void save_stats(const struct ImageStats *stats, const char *filename, int current_step);
 void save_img_as_png(const struct Image *img, const char *filename_format, int current_step);
+
+// Untimed kernels over a range of bodies or image rows, for callers that
+// split one step across threads. simulate_n_bodies_velocities reads every
+// position, so all velocities must be updated before move_n_bodies.
+void simulate_n_bodies_velocities(struct Body bodies[], int n, double dt, int begin, int end);
+void move_n_bodies(struct Body bodies[], double dt, int begin, int end);
+void generate_image_rows(struct Body bodies[], int n, struct Image * img, int y0, int y1);
+void apply_gaussian_blur_rows(struct Image *img_in, struct Image *img_out, int y0, int y1);
+void convert_to_grayscale_rows(struct Image *img_in, struct Image *img_out, int y0, int y1);
+void accumulate_histogram_rows(const struct Image *img, int histogram[256], int y0, int y1);
+void image_statistics_from_histogram(const int histogram[256], int total_count, struct ImageStats *stats);
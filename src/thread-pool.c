@@ -0,0 +1,122 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "thread-pool.h"
+#include "trace.h"
+
+// Chunks per thread: more than one so that a slow thread does not hold the
+// whole job back.
+#define CHUNKS_PER_THREAD 4
+
+static void run_chunks(struct ThreadPool *pool) {
+  for (;;) {
+    int begin = atomic_fetch_add_explicit(&pool->next, pool->chunk, memory_order_relaxed);
+    if (begin >= pool->end)
+      return;
+    int end = begin + pool->chunk < pool->end ? begin + pool->chunk : pool->end;
+    pool->fn(pool->ctx, begin, end);
+  }
+}
+
+static void * pool_thread(void *arg) {
+  struct ThreadPool *pool = arg;
+  unsigned int seen = 0;
+  trace_thread_name("pool");
+
+  pthread_mutex_lock(&pool->mutex);
+  for (;;) {
+    while (pool->generation == seen && !pool->stop)
+      pthread_cond_wait(&pool->work, &pool->mutex);
+    if (pool->stop)
+      break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->mutex);
+
+    run_chunks(pool);
+
+    pthread_mutex_lock(&pool->mutex);
+    if (--pool->busy == 0)
+      pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+void thread_pool_init(struct ThreadPool *pool, int n_threads, const struct Affinity *affinity) {
+  memset(pool, 0, sizeof(struct ThreadPool));
+  pool->n_threads = n_threads > 0 ? n_threads : 1;
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+  atomic_init(&pool->next, 0);
+
+  pool->threads = malloc(pool->n_threads * sizeof(pthread_t));
+  if (pool->threads == NULL) {
+    perror("cannot allocate thread pool");
+    exit(1);
+  }
+  if (affinity != NULL)
+    affinity_pin_self(affinity, 0);
+  for (int i = 1; i < pool->n_threads; i++) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (affinity != NULL)
+      affinity_set_attr(affinity, i, &attr);
+    int err = pthread_create(&pool->threads[i], &attr, pool_thread, pool);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+      fprintf(stderr, "cannot start pool thread %d: %s\n", i, strerror(err));
+      exit(1);
+    }
+  }
+}
+
+void thread_pool_destroy(struct ThreadPool *pool) {
+  pthread_mutex_lock(&pool->mutex);
+  pool->stop = true;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->mutex);
+  for (int i = 1; i < pool->n_threads; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  free(pool->threads);
+  pthread_mutex_destroy(&pool->mutex);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+}
+
+void parallel_for(struct ThreadPool *pool, int begin, int end, int grain, parallel_for_fn fn, void *ctx) {
+  if (grain < 1)
+    grain = 1;
+  if (pool->n_threads == 1 || end - begin <= grain) {
+    if (begin < end)
+      fn(ctx, begin, end);
+    return;
+  }
+
+  int chunks = pool->n_threads * CHUNKS_PER_THREAD;
+  int chunk = (end - begin + chunks - 1) / chunks;
+  if (chunk < grain)
+    chunk = grain;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->fn = fn;
+  pool->ctx = ctx;
+  pool->end = end;
+  pool->chunk = chunk;
+  atomic_store_explicit(&pool->next, begin, memory_order_relaxed);
+  pool->busy = pool->n_threads - 1;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->mutex);
+
+  run_chunks(pool);
+
+  pthread_mutex_lock(&pool->mutex);
+  while (pool->busy > 0)
+    pthread_cond_wait(&pool->done, &pool->mutex);
+  pthread_mutex_unlock(&pool->mutex);
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "affinity.h"
+
+// Persistent pool of threads for data parallelism inside one step. The
+// calling thread takes part in every parallel_for and counts as thread 0, so
+// a pool of n threads starts n - 1 of them.
+
+typedef void (*parallel_for_fn)(void *ctx, int begin, int end);
+
+struct ThreadPool {
+  int n_threads;
+  pthread_t *threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  unsigned int generation;  // bumped for every job
+  int busy;                 // threads still working on the current job
+  bool stop;
+
+  // Current job: [next, end) cut in chunks of `chunk` items.
+  parallel_for_fn fn;
+  void *ctx;
+  int end;
+  int chunk;
+  atomic_int next;
+};
+
+// Thread i is placed according to `affinity` (NULL: not pinned).
+void thread_pool_init(struct ThreadPool *pool, int n_threads, const struct Affinity *affinity);
+void thread_pool_destroy(struct ThreadPool *pool);
+
+// Calls fn on disjoint sub-ranges covering [begin, end) and returns once they
+// are all done. Ranges shorter than `grain` items are not split further; a
+// range of at most `grain` items runs in the calling thread only.
+void parallel_for(struct ThreadPool *pool, int begin, int end, int grain, parallel_for_fn fn, void *ctx);
@@ -0,0 +1,179 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+enum TraceKind {
+  TRACE_SPAN
+, TRACE_COUNTER
+};
+
+struct TraceEvent {
+  enum TraceKind kind;
+  const char *name;
+  int64_t ts;
+  int64_t dur;        // span: duration; counter: value
+  int64_t wait;
+  int step;
+  int n_steps;
+};
+
+struct TraceBuffer {
+  int tid;
+  char name[32];
+  struct TraceEvent *events;
+  size_t count;
+  size_t capacity;
+  struct TraceBuffer *next;
+};
+
+bool trace_on = false;
+static const char *trace_filename;
+static int64_t trace_epoch;
+
+static pthread_mutex_t buffers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct TraceBuffer *buffers = NULL;
+static int n_buffers = 0;
+static _Thread_local struct TraceBuffer *local_buffer = NULL;
+
+int64_t trace_now(void) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+    perror("clock_gettime");
+    exit(1);
+  }
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static struct TraceBuffer * thread_buffer(void) {
+  if (local_buffer != NULL)
+    return local_buffer;
+
+  struct TraceBuffer *b = calloc(1, sizeof(struct TraceBuffer));
+  if (b == NULL) {
+    perror("cannot allocate trace buffer");
+    exit(1);
+  }
+  pthread_mutex_lock(&buffers_mutex);
+  b->tid = ++n_buffers;
+  b->next = buffers;
+  buffers = b;
+  pthread_mutex_unlock(&buffers_mutex);
+  snprintf(b->name, sizeof(b->name), "thread %d", b->tid);
+  local_buffer = b;
+  return b;
+}
+
+static struct TraceEvent * new_event(void) {
+  struct TraceBuffer *b = thread_buffer();
+  if (b->count == b->capacity) {
+    b->capacity = b->capacity == 0 ? 1024 : 2 * b->capacity;
+    b->events = realloc(b->events, b->capacity * sizeof(struct TraceEvent));
+    if (b->events == NULL) {
+      perror("cannot grow trace buffer");
+      exit(1);
+    }
+  }
+  return &b->events[b->count++];
+}
+
+void trace_open_from_env(void) {
+  trace_filename = getenv("DM_TRACE");
+  if (trace_filename == NULL || trace_filename[0] == '\0')
+    return;
+  trace_epoch = trace_now();
+  trace_on = true;
+  trace_thread_name("main");
+}
+
+void trace_thread_name(const char *name) {
+  if (!trace_on)
+    return;
+  struct TraceBuffer *b = thread_buffer();
+  snprintf(b->name, sizeof(b->name), "%s", name);
+}
+
+void trace_span(const char *name, int64_t begin_ns, int64_t end_ns, int step, int n_steps, int64_t wait_ns) {
+  if (!trace_on)
+    return;
+  struct TraceEvent *e = new_event();
+  e->kind = TRACE_SPAN;
+  e->name = name;
+  e->ts = begin_ns;
+  e->dur = end_ns - begin_ns;
+  e->step = step;
+  e->n_steps = n_steps;
+  e->wait = wait_ns;
+}
+
+void trace_counter(const char *name, int64_t value) {
+  if (!trace_on)
+    return;
+  struct TraceEvent *e = new_event();
+  e->kind = TRACE_COUNTER;
+  e->name = name;
+  e->ts = trace_now();
+  e->dur = value;
+}
+
+// Timestamps are in µs in the file.
+static void write_event(FILE *fp, int tid, const struct TraceEvent *e) {
+  double ts = (e->ts - trace_epoch) / 1e3;
+  if (e->kind == TRACE_COUNTER) {
+    fprintf(fp, ",\n{\"ph\":\"C\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"name\":\"%s\",\"args\":{\"value\":%ld}}",
+            tid, ts, e->name, e->dur);
+    return;
+  }
+  fprintf(fp, ",\n{\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"name\":\"%s\",\"args\":{",
+          tid, ts, e->dur / 1e3, e->name);
+  const char *sep = "";
+  if (e->step >= 0) {
+    fprintf(fp, "\"step\":%d", e->step);
+    sep = ",";
+  }
+  if (e->n_steps >= 0) {
+    fprintf(fp, "%s\"steps\":%d", sep, e->n_steps);
+    sep = ",";
+  }
+  if (e->wait >= 0)
+    fprintf(fp, "%s\"wait_us\":%.3f", sep, e->wait / 1e3);
+  fprintf(fp, "}}");
+}
+
+void trace_close(void) {
+  if (!trace_on)
+    return;
+  trace_on = false;
+
+  FILE *fp = fopen(trace_filename, "w");
+  if (fp == NULL) {
+    perror("cannot open trace file");
+    exit(1);
+  }
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(fp, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"dm\"}}");
+
+  pthread_mutex_lock(&buffers_mutex);
+  for (struct TraceBuffer *b = buffers; b != NULL; b = b->next) {
+    fprintf(fp, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}", b->tid, b->name);
+    fprintf(fp, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"name\":\"thread_sort_index\",\"args\":{\"sort_index\":%d}}", b->tid, b->tid);
+    for (size_t i = 0; i < b->count; i++)
+      write_event(fp, b->tid, &b->events[i]);
+  }
+  while (buffers != NULL) {
+    struct TraceBuffer *next = buffers->next;
+    free(buffers->events);
+    free(buffers);
+    buffers = next;
+  }
+  pthread_mutex_unlock(&buffers_mutex);
+
+  fprintf(fp, "\n]}\n");
+  if (fclose(fp) != 0) {
+    perror("cannot write trace file");
+    exit(1);
+  }
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Timeline recorder, enabled with DM_TRACE=file.json. Every thread appends
+// spans and counters to its own buffer; trace_close writes them all in the
+// Chrome trace event format, which opens in Perfetto (ui.perfetto.dev) and in
+// chrome://tracing. Without DM_TRACE, every call returns at once.
+//
+// Names are not copied: they must live until trace_close.
+
+extern bool trace_on;
+
+// Reads DM_TRACE and names the calling thread "main".
+void trace_open_from_env(void);
+// Writes the file. Threads must no longer record.
+void trace_close(void);
+
+// ns on CLOCK_MONOTONIC.
+int64_t trace_now(void);
+// Copied, unlike event names.
+void trace_thread_name(const char *name);
+
+// One execution of `name` on the calling thread. Arguments shown with the
+// span: `step` and `n_steps` when >= 0, and `wait_ns` (time spent queued
+// before the span started) when >= 0.
+void trace_span(const char *name, int64_t begin_ns, int64_t end_ns, int step, int n_steps, int64_t wait_ns);
+// Value of counter `name` from now on.
+void trace_counter(const char *name, int64_t value);
@@ -0,0 +1,102 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ws-deque.h"
+
+static struct WsBuffer * alloc_buffer(int64_t size, size_t elem_size) {
+  struct WsBuffer *buf = malloc(sizeof(struct WsBuffer) + size * elem_size);
+  if (buf == NULL) {
+    perror("cannot allocate work-stealing deque");
+    exit(1);
+  }
+  buf->size = size;
+  buf->prev = NULL;
+  return buf;
+}
+
+static void * slot(struct WsBuffer *buf, int64_t i, size_t elem_size) {
+  return buf->data + (i & (buf->size - 1)) * elem_size;
+}
+
+void ws_deque_init(struct WsDeque *d, size_t capacity, size_t elem_size) {
+  int64_t size = 2;
+  while (size < (int64_t)capacity)
+    size *= 2;
+
+  d->elem_size = elem_size;
+  atomic_init(&d->top, 0);
+  atomic_init(&d->bottom, 0);
+  atomic_init(&d->buffer, alloc_buffer(size, elem_size));
+}
+
+void ws_deque_destroy(struct WsDeque *d) {
+  struct WsBuffer *buf = atomic_load(&d->buffer);
+  while (buf != NULL) {
+    struct WsBuffer *prev = buf->prev;
+    free(buf);
+    buf = prev;
+  }
+}
+
+static struct WsBuffer * grow(struct WsDeque *d, struct WsBuffer *old, int64_t top, int64_t bottom) {
+  struct WsBuffer *buf = alloc_buffer(2 * old->size, d->elem_size);
+  for (int64_t i = top; i < bottom; i++)
+    memcpy(slot(buf, i, d->elem_size), slot(old, i, d->elem_size), d->elem_size);
+  buf->prev = old;
+  atomic_store_explicit(&d->buffer, buf, memory_order_release);
+  return buf;
+}
+
+void ws_deque_push(struct WsDeque *d, const void *elem) {
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+  struct WsBuffer *buf = atomic_load_explicit(&d->buffer, memory_order_relaxed);
+  if (b - t > buf->size - 1)
+    buf = grow(d, buf, t, b);
+  memcpy(slot(buf, b, d->elem_size), elem, d->elem_size);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+}
+
+bool ws_deque_take(struct WsDeque *d, void *elem) {
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+  struct WsBuffer *buf = atomic_load_explicit(&d->buffer, memory_order_relaxed);
+  atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+
+  if (t > b) {
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return false;
+  }
+
+  memcpy(elem, slot(buf, b, d->elem_size), d->elem_size);
+  if (t == b) {
+    // last element: race against thieves for it
+    bool won = atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return won;
+  }
+  return true;
+}
+
+bool ws_deque_steal(struct WsDeque *d, void *elem) {
+  int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+  if (t >= b)
+    return false;
+
+  struct WsBuffer *buf = atomic_load_explicit(&d->buffer, memory_order_acquire);
+  memcpy(elem, slot(buf, t, d->elem_size), d->elem_size);
+  return atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+}
+
+// Approximate when other threads are stealing concurrently.
+int64_t ws_deque_size(struct WsDeque *d) {
+  int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+  int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+  return b > t ? b - t : 0;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "task-queue.h"
+
+// Work-stealing deque (Chase & Lev, with the C11 orderings of Lê et al.,
+// "Correct and Efficient Work-Stealing for Weak Memory Models", PPoPP 2013).
+// The owner pushes and takes at the bottom, LIFO; other threads steal from
+// the top, FIFO. The buffer grows when full, so a push never blocks. Buffers
+// replaced by a resize are kept until ws_deque_destroy because a thief may
+// still be reading them.
+
+struct WsBuffer {
+  int64_t size;
+  struct WsBuffer *prev;
+  unsigned char data[];
+};
+
+struct WsDeque {
+  size_t elem_size;
+  alignas(CACHE_LINE_SIZE) atomic_int_fast64_t top;
+  alignas(CACHE_LINE_SIZE) atomic_int_fast64_t bottom;
+  _Atomic(struct WsBuffer *) buffer;
+};
+
+void ws_deque_init(struct WsDeque *d, size_t capacity, size_t elem_size);
+void ws_deque_destroy(struct WsDeque *d);
+
+// Owner side.
+void ws_deque_push(struct WsDeque *d, const void *elem);
+bool ws_deque_take(struct WsDeque *d, void *elem);
+
+// Any thread. Fails when empty or when losing a race with another thief.
+bool ws_deque_steal(struct WsDeque *d, void *elem);
+int64_t ws_deque_size(struct WsDeque *d);